@@ -0,0 +1,335 @@
+// Microbenchmarks for the shell's hot paths, results are written to stdout as
+// JSON so two runs can be compared with bench/compare.sh.
+//
+// usage: shelly-bench [-r runs] [name...]
+//
+// Only benchmarks whose name starts with one of the given names are run.
+// Progress goes to stderr. The shell's own output, and that of the programs
+// it starts, goes to /dev/null.
+
+#define main shelly_main
+#include "../shell.c"
+#undef main
+
+#include <dirent.h>
+
+#define BENCH_RUNS_DEFAULT 5
+
+typedef struct Bench Bench;
+// Runs ops operations and returns how long they took in ns
+typedef int64_t (*BenchFunc)(const Bench *bench, long ops);
+
+struct Bench {
+	const char *name;
+	BenchFunc func;
+	long ops; // Per run
+	const char *arg;
+	long size; // Bytes per op for throughput, entries for the history
+};
+
+static int json_fd;
+static int num_results;
+static char bench_home[] = "/tmp/shelly-bench-XXXXXX";
+static Shell bench_shell; // For the background jobs
+
+static int cmp_ns(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+// One JSON object per line, so compare.sh can get by with awk
+static void report(const Bench *bench, int runs, int64_t *ns)
+{
+	double per_op;
+	FILE *out = fdopen(dup(json_fd), "w");
+
+	// The median is steadier than the mean when something else wakes up
+	qsort(ns, runs, sizeof(*ns), cmp_ns);
+	per_op = (double) ns[runs / 2] / bench->ops;
+
+	fprintf(out, "%s    {\"name\": \"%s\", \"runs\": %d, \"ops\": %ld, "
+		"\"ns_per_op\": %.1f, \"min_ns_per_op\": %.1f, \"ops_per_s\": %.0f",
+		num_results ? ",\n" : "", bench->name, runs, bench->ops,
+		per_op, (double) ns[0] / bench->ops, 1e9 / per_op);
+	if (bench->size > 0 && strncmp(bench->name, "read_hist_file", 14) != 0)
+		fprintf(out, ", \"mb_per_s\": %.1f", bench->size * 1e3 / per_op);
+	fprintf(out, "}");
+	fclose(out);
+	num_results++;
+
+	fprintf(stderr, "%-36s %12.1f ns/op\n", bench->name, per_op);
+}
+
+static int64_t bench_parse(const Bench *bench, long ops)
+{
+	Arena arena = {0};
+	const CmdDef *cmd_def;
+	CmdArgv argv;
+	int argc;
+	int64_t start = now_ns();
+
+	for (long i = 0; i < ops; i++) {
+		parse(&arena, &cmd_def, &argv, &argc, bench->arg);
+		arena_reset(&arena);
+	}
+	start = now_ns() - start;
+	arena_free(&arena);
+	return start;
+}
+
+static int64_t bench_expand(const Bench *bench, long ops)
+{
+	StrBuf out = {0};
+	size_t len = strlen(bench->arg);
+	int64_t start = now_ns();
+
+	for (long i = 0; i < ops; i++) {
+		out.len = 0;
+		expand_vars(&out, bench->arg, len);
+	}
+	start = now_ns() - start;
+	free(out.data);
+	return start;
+}
+
+static char *hist_path(const Bench *bench)
+{
+	static char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/hist-%s-%ld", bench_home,
+		bench->arg, bench->size);
+	return path;
+}
+
+// Writes a history file with bench->size entries, in bench->arg's format
+static void make_hist_file(const Bench *bench)
+{
+	CmdHist hist = {0};
+	HistMeta meta = {0};
+	char cmd[64];
+	FILE *file;
+	int len;
+
+	if (strcmp(bench->arg, "text") == 0) {
+		file = fopen(hist_path(bench), "w");
+		for (long i = 0; i < bench->size; i++)
+			fprintf(file, "start echo entry %ld\n", i);
+		fclose(file);
+		return;
+	}
+
+	meta.cwd = "/home/user";
+	for (long i = 0; i < bench->size; i++) {
+		len = snprintf(cmd, sizeof(cmd), "start echo entry %ld", i);
+		meta.when = i;
+		hist_push(&hist, cmd, len, &meta);
+	}
+	hist_file_rewrite(hist_path(bench), &hist, 0, hist.len);
+	hist_free(&hist);
+}
+
+// Loads the file ops times. A text file isn't migrated, so every load reads
+// all of it.
+static int64_t bench_read_hist(const Bench *bench, long ops)
+{
+	Shell shelly;
+	int64_t total = 0, start;
+	int fd;
+
+	for (long i = 0; i < ops; i++) {
+		memset(&shelly.hist, 0, sizeof(shelly.hist));
+		shelly.hist.binary = strcmp(bench->arg, "binary") == 0;
+		shelly.hist.fd = -1;
+		shelly.hist_filepath = hist_path(bench);
+
+		start = now_ns();
+		fd = open(shelly.hist_filepath, O_RDONLY | O_CLOEXEC);
+		read_hist_file(&shelly, fd);
+		close(fd);
+		total += now_ns() - start;
+
+		if (shelly.hist.len != bench->size) {
+			fprintf(stderr, "%s: loaded %d entries\n", bench->name, shelly.hist.len);
+			exit(1);
+		}
+		hist_free(&shelly.hist);
+	}
+	return total;
+}
+
+// Starts /bin/true in the foreground and waits for it, with the backend in
+// bench->arg
+static int64_t bench_launch(const Bench *bench, long ops)
+{
+	char *argv[] = { "/bin/true", NULL };
+	int fds[REDIR_MAX_FD];
+	int64_t start;
+
+	for (int fd = 0; fd < REDIR_MAX_FD; fd++)
+		fds[fd] = -1;
+	var_set(ENV_SPAWN, bench->arg, 0);
+
+	start = now_ns();
+	for (long i = 0; i < ops; i++)
+		launch_process(argv, 0, fds, 1);
+	return now_ns() - start;
+}
+
+// Starts ops background jobs through run_line(), then waits until the event
+// loop has reaped them all
+static int64_t bench_background(const Bench *bench, long ops)
+{
+	char line[64];
+	long finished = bench_shell.jobs.num_finished + ops;
+	int64_t start = now_ns();
+
+	snprintf(line, sizeof(line), "%s", bench->arg);
+	for (long i = 0; i < ops; i++)
+		run_line(&bench_shell, line);
+	while (bench_shell.jobs.num_finished < finished)
+		wait_events(&bench_shell, 1000);
+	return now_ns() - start;
+}
+
+// A line of refs references, as in bench/expand.sh
+static char *expand_line(int refs)
+{
+	StrBuf line = {0};
+
+	sb_append(&line, "set X ", 6);
+	for (int i = 0; i < refs; i++) {
+		if (i % 3 == 0)
+			sb_append(&line, "$FOO:", 5);
+		else if (i % 3 == 1)
+			sb_append(&line, "${FOO}/", 7);
+		else
+			sb_append(&line, "${NOPE:-dflt}.", 14);
+	}
+	sb_append(&line, "", 1);
+	return line.data;
+}
+
+// A start line with args arguments
+static char *long_line(int args)
+{
+	StrBuf line = {0};
+	char arg[32];
+
+	sb_append(&line, "start /bin/echo", 15);
+	for (int i = 0; i < args; i++)
+		sb_append(&line, arg, snprintf(arg, sizeof(arg), " argument%d", i));
+	sb_append(&line, "", 1);
+	return line.data;
+}
+
+static void remove_home(void)
+{
+	DIR *dir = opendir(bench_home);
+	struct dirent *ent;
+
+	while (dir && (ent = readdir(dir)) != NULL) {
+		if (strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0)
+			unlinkat(dirfd(dir), ent->d_name, 0);
+	}
+	if (dir)
+		closedir(dir);
+	rmdir(bench_home);
+}
+
+static int selected(const char *name, char **names, int num_names)
+{
+	if (num_names == 0)
+		return 1;
+	for (int i = 0; i < num_names; i++) {
+		if (strncmp(name, names[i], strlen(names[i])) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	char *expand_4k = expand_line(500);
+	char *expand_64k = expand_line(8000);
+	char *parse_long = long_line(1000);
+	Bench benches[] = {
+		{ "parse/simple", bench_parse, 1000000, "start /bin/echo hello world" },
+		{ "parse/pipeline", bench_parse, 500000,
+			"start cat < in.txt | grep -v foo | sort -r | uniq -c > out.txt 2>&1" },
+		{ "parse/1000_args", bench_parse, 2000, parse_long, strlen(parse_long) },
+		{ "expand_vars/plain", bench_expand, 1000000, "start /bin/echo hello world" },
+		{ "expand_vars/4k", bench_expand, 5000, expand_4k, strlen(expand_4k) },
+		{ "expand_vars/64k", bench_expand, 300, expand_64k, strlen(expand_64k) },
+		{ "read_hist_file/binary/1000", bench_read_hist, 200, "binary", 1000 },
+		{ "read_hist_file/binary/10000", bench_read_hist, 200, "binary", 10000 },
+		{ "read_hist_file/binary/100000", bench_read_hist, 200, "binary", 100000 },
+		{ "read_hist_file/binary/1000000", bench_read_hist, 200, "binary", 1000000 },
+		{ "read_hist_file/text/1000", bench_read_hist, 200, "text", 1000 },
+		{ "read_hist_file/text/10000", bench_read_hist, 50, "text", 10000 },
+		{ "read_hist_file/text/100000", bench_read_hist, 5, "text", 100000 },
+		{ "read_hist_file/text/1000000", bench_read_hist, 1, "text", 1000000 },
+		{ "launch_process/spawn", bench_launch, 1000, "spawn" },
+		{ "launch_process/fork", bench_launch, 1000, "fork" },
+		{ "background/reap", bench_background, 1000, "background /bin/true" },
+	};
+	int num_benches = sizeof(benches) / sizeof(benches[0]);
+	int runs = BENCH_RUNS_DEFAULT;
+	int64_t *ns;
+	int dev_null;
+
+	if (argc > 2 && strcmp(argv[1], "-r") == 0) {
+		runs = atoi(argv[2]);
+		argc -= 2;
+		argv += 2;
+	}
+	if (runs < 1 || (argc > 1 && argv[1][0] == '-')) {
+		fprintf(stderr, "usage: shelly-bench [-r runs] [name...]\n");
+		return 2;
+	}
+	ns = (int64_t *) malloc(sizeof(*ns) * runs);
+
+	if (mkdtemp(bench_home) == NULL) {
+		perror("mkdtemp");
+		return 1;
+	}
+	setenv("HOME", bench_home, 1);
+	setenv("HISTSIZE", "-1", 1);
+	unsetenv(ENV_SPAWN);
+	setenv("FOO", "some_value", 1);
+	unsetenv("NOPE");
+
+	// Keep the JSON clean of everything the shell prints
+	json_fd = dup(STDOUT_FILENO);
+	dev_null = open("/dev/null", O_RDWR);
+	dup2(dev_null, STDOUT_FILENO);
+	dup2(dev_null, STDIN_FILENO);
+	close(dev_null);
+
+	// Sets up the variables and the event loop, not interactive
+	init_shell(&bench_shell, 0);
+
+	dprintf(json_fd, "{\n  \"runs\": %d,\n  \"benchmarks\": [\n", runs);
+	for (int i = 0; i < num_benches; i++) {
+		if (!selected(benches[i].name, argv + 1, argc - 1))
+			continue;
+		if (benches[i].func == bench_read_hist)
+			make_hist_file(&benches[i]);
+		// Warm up caches (and the path lookup) outside the timed runs
+		benches[i].func(&benches[i], benches[i].ops / 10 + 1);
+		for (int run = 0; run < runs; run++)
+			ns[run] = benches[i].func(&benches[i], benches[i].ops);
+		report(&benches[i], runs, ns);
+		if (benches[i].func == bench_read_hist)
+			unlink(hist_path(&benches[i]));
+	}
+	dprintf(json_fd, "\n  ]\n}\n");
+
+	remove_home();
+	free(ns);
+	free(expand_4k);
+	free(expand_64k);
+	free(parse_long);
+	return 0;
+}
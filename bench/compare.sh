@@ -0,0 +1,48 @@
+#!/bin/sh
+# Compares two `make bench` results and flags what got slower.
+#
+# usage: bench/compare.sh <old.json> <new.json> [threshold %]
+#
+# Exits with 1 if any benchmark's ns/op grew by more than the threshold
+# (default 10%).
+
+if [ $# -lt 2 ]; then
+	echo "usage: bench/compare.sh <old.json> <new.json> [threshold %]" >&2
+	exit 2
+fi
+THRESHOLD=${3:-10}
+
+# shelly-bench writes one benchmark per line
+awk -v threshold="$THRESHOLD" '
+function field(line, key,    m) {
+	if (match(line, "\"" key "\": *\"?[^,\"}]*")) {
+		m = substr(line, RSTART, RLENGTH)
+		sub(/^"[^"]*": *"?/, "", m)
+		return m
+	}
+	return ""
+}
+/"name":/ {
+	name = field($0, "name")
+	ns = field($0, "ns_per_op")
+	if (FILENAME == ARGV[1]) {
+		old[name] = ns
+		next
+	}
+	if (!(name in old)) {
+		printf "%-36s %12s %12.1f %9s\n", name, "-", ns, "new"
+		next
+	}
+	change = old[name] > 0 ? (ns - old[name]) * 100 / old[name] : 0
+	flag = change > threshold ? "  REGRESSION" : ""
+	if (flag != "")
+		regressions++
+	printf "%-36s %12.1f %12.1f %+8.1f%%%s\n", name, old[name], ns, change, flag
+}
+BEGIN { printf "%-36s %12s %12s %9s\n", "benchmark (ns/op)", "old", "new", "change" }
+END {
+	if (regressions) {
+		printf "%d benchmark(s) slower by more than %s%%\n", regressions, threshold
+		exit 1
+	}
+}' "$1" "$2"
@@ -0,0 +1,30 @@
+#!/bin/sh
+# Variable expansion throughput on multi-KB command lines.
+#
+# usage: bench/expand.sh [lines] [refs per line]
+#
+# Each line is a `set` whose value mixes text, $VAR, ${VAR} and
+# ${UNSET:-default} references, so the time is mostly expansion.
+
+SHELLY=${SHELLY:-./shelly}
+LINES=${1:-10000}
+REFS=${2:-500}
+BENCH_HOME=$(mktemp -d)
+trap 'rm -rf "$BENCH_HOME"' EXIT
+
+awk -v n="$LINES" -v refs="$REFS" 'BEGIN {
+	print "set FOO some_value"
+	for (i = 0; i < n; i++) {
+		line = "set X"
+		for (j = 0; j < refs; j++)
+			line = line (j % 3 == 0 ? "$FOO:" : j % 3 == 1 ? "${FOO}/" : "${NOPE:-dflt}.")
+		print line
+	}
+}' > "$BENCH_HOME/script.sh"
+bytes=$(wc -c < "$BENCH_HOME/script.sh")
+echo "lines: $LINES, line length: $((bytes / LINES)) bytes"
+
+start=$(date +%s%N)
+HOME=$BENCH_HOME "$SHELLY" "$BENCH_HOME/script.sh" > /dev/null
+end=$(date +%s%N)
+echo "$((LINES * 1000000000 / (end - start))) lines/s, $((bytes * 1000 / (end - start))) MB/s"
@@ -0,0 +1,36 @@
+#!/bin/sh
+# Time to dump a large history to a pipe.
+#
+# usage: bench/hist_print.sh [entries] [runs]
+
+SHELLY=${SHELLY:-./shelly}
+ENTRIES=${1:-1000000}
+RUNS=${2:-5}
+BENCH_HOME=$(mktemp -d)
+trap 'rm -rf "$BENCH_HOME"' EXIT
+# All of it, not the last HISTSIZE entries
+HISTSIZE=-1
+export HISTSIZE
+
+# Average wall time of RUNS runs of `shelly -c "$1"` piped to cat, in ms
+time_print() {
+	start=$(date +%s%N)
+	i=0
+	while [ $i -lt "$RUNS" ]; do
+		HOME=$BENCH_HOME "$SHELLY" -c "$1" | cat > /dev/null
+		i=$((i + 1))
+	done
+	end=$(date +%s%N)
+	echo $(((end - start) / RUNS / 1000000))
+}
+
+awk -v n="$ENTRIES" 'BEGIN { for (i = 0; i < n; i++) printf "start echo entry %d\n", i }' \
+	> "$BENCH_HOME/.shelly-history"
+# Migrate it to the binary format
+HOME=$BENCH_HOME "$SHELLY" -c 'history 1' > /dev/null
+echo "history entries: $ENTRIES"
+
+echo "history:         $(time_print history) ms"
+echo "history -t:      $(time_print 'history -t') ms"
+echo "history 100:     $(time_print 'history 100') ms"
+echo "history -r 10 0: $(time_print 'history -r 10 0') ms"
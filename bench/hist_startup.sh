@@ -0,0 +1,31 @@
+#!/bin/sh
+# Startup time of shelly with a large history file, legacy text vs binary.
+#
+# usage: bench/hist_startup.sh [entries] [runs]
+
+SHELLY=${SHELLY:-./shelly}
+ENTRIES=${1:-1000000}
+RUNS=${2:-10}
+BENCH_HOME=$(mktemp -d)
+trap 'rm -rf "$BENCH_HOME"' EXIT
+
+# Average wall time of RUNS startups that exit right away, in ms
+time_startup() {
+	start=$(date +%s%N)
+	i=0
+	while [ $i -lt "$RUNS" ]; do
+		printf 'exit\n' | HOME=$BENCH_HOME "$@" "$SHELLY" > /dev/null
+		i=$((i + 1))
+	done
+	end=$(date +%s%N)
+	echo $(((end - start) / RUNS / 1000000))
+}
+
+awk -v n="$ENTRIES" 'BEGIN { for (i = 0; i < n; i++) printf "start echo entry %d\n", i }' \
+	> "$BENCH_HOME/.shelly-history"
+echo "history entries: $ENTRIES"
+echo "text:   $(time_startup env SHELLY_HIST_FORMAT=text) ms"
+
+# First binary startup migrates the text file
+printf 'exit\n' | HOME=$BENCH_HOME "$SHELLY" > /dev/null
+echo "binary: $(time_startup env) ms"
@@ -0,0 +1,26 @@
+#!/bin/sh
+# Lines per second shelly runs from a script, as a file and on stdin.
+#
+# usage: bench/script.sh [lines]
+
+SHELLY=${SHELLY:-./shelly}
+LINES=${1:-100000}
+BENCH_HOME=$(mktemp -d)
+trap 'rm -rf "$BENCH_HOME"' EXIT
+
+# Builtins only so the shell itself is measured, not fork/exec
+awk -v n="$LINES" 'BEGIN {
+	print "# benchmark script"
+	for (i = 0; i < n; i++) printf "set X%d %d\n", i % 64, i
+}' > "$BENCH_HOME/script.sh"
+echo "lines: $LINES"
+
+start=$(date +%s%N)
+HOME=$BENCH_HOME "$SHELLY" "$BENCH_HOME/script.sh" > /dev/null
+end=$(date +%s%N)
+echo "file:  $((LINES * 1000000000 / (end - start))) lines/s"
+
+start=$(date +%s%N)
+HOME=$BENCH_HOME "$SHELLY" < "$BENCH_HOME/script.sh" > /dev/null
+end=$(date +%s%N)
+echo "stdin: $((LINES * 1000000000 / (end - start))) lines/s"
@@ -0,0 +1,25 @@
+#!/bin/sh
+# Spawns per second of each launch backend under `repeat N true`.
+#
+# usage: bench/spawn.sh [count] [history entries]
+#
+# The history entries are loaded into memory (text format) to grow the
+# shell's address space, which is what fork() pays for.
+
+SHELLY=${SHELLY:-./shelly}
+COUNT=${1:-10000}
+ENTRIES=${2:-0}
+BENCH_HOME=$(mktemp -d)
+trap 'rm -rf "$BENCH_HOME"' EXIT
+
+awk -v n="$ENTRIES" 'BEGIN { for (i = 0; i < n; i++) printf "start echo entry %d\n", i }' \
+	> "$BENCH_HOME/.shelly-history"
+echo "spawns: $COUNT, history entries: $ENTRIES"
+
+for backend in fork spawn; do
+	start=$(date +%s%N)
+	printf 'repeat %d true\nexit\n' "$COUNT" \
+		| HOME=$BENCH_HOME SHELLY_HIST_FORMAT=text SHELLY_SPAWN=$backend "$SHELLY" > /dev/null
+	end=$(date +%s%N)
+	echo "$backend: $((COUNT * 1000000000 / (end - start))) spawns/s"
+done
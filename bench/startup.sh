@@ -0,0 +1,41 @@
+#!/bin/sh
+# Cold start to exit latency of shelly, checked against a budget.
+#
+# usage: bench/startup.sh [runs] [budget us] [history entries]
+#
+# Exits non-zero if `shelly -c exit` averages more than the budget. The
+# history file is there to show it isn't read unless a command needs it.
+
+SHELLY=${SHELLY:-./shelly}
+RUNS=${1:-1000}
+BUDGET_US=${2:-2000}
+ENTRIES=${3:-1000000}
+BENCH_HOME=$(mktemp -d)
+trap 'rm -rf "$BENCH_HOME"' EXIT
+
+# Average wall time of RUNS runs of the given shelly arguments, in us
+time_runs() {
+	start=$(date +%s%N)
+	i=0
+	while [ $i -lt "$RUNS" ]; do
+		HOME=$BENCH_HOME "$SHELLY" "$@" < /dev/null > /dev/null
+		i=$((i + 1))
+	done
+	end=$(date +%s%N)
+	echo $(((end - start) / RUNS / 1000))
+}
+
+awk -v n="$ENTRIES" 'BEGIN { for (i = 0; i < n; i++) printf "start echo entry %d\n", i }' \
+	> "$BENCH_HOME/.shelly-history"
+# Migrate it to the binary format
+HOME=$BENCH_HOME "$SHELLY" -c history > /dev/null
+echo "runs: $RUNS, history entries: $ENTRIES"
+
+baseline=$(time_runs -c exit)
+echo "-c exit:    $baseline us"
+echo "-c true:    $(time_runs -c true) us"
+
+if [ "$baseline" -gt "$BUDGET_US" ]; then
+	echo "over budget ($BUDGET_US us)"
+	exit 1
+fi
@@ -0,0 +1,149 @@
+// Random-input driver for expand_vars(), built with ASan and UBSan by
+// `make fuzz-expand`. Lines are made mostly of the characters that mean
+// something to the expansion ($ { } : - \ and variable names), with the odd
+// random byte, and every result is checked against ref_expand(), a slow
+// character at a time version of the same rules.
+//
+// usage: shelly-fuzz-expand [iterations] [seed]
+//
+// A mismatch prints the seed, iteration and input and exits with 1. Run it
+// again with that seed to reproduce it.
+
+#define main shelly_main
+#include "../shell.c"
+#undef main
+
+#define FUZZ_MAX_LEN 256
+
+static char *no_env[] = { NULL };
+static const char fuzz_chars[] = "${}:-\\$$${{}}AEXLN_1 a";
+
+// Where the ${ at str[0] ends (its }), end if it doesn't
+static const char *ref_close(const char *str, const char *end)
+{
+	int depth = 1;
+
+	for (str += 2; str < end; str++) {
+		if (str + 1 < end && str[0] == '$' && str[1] == '{') {
+			depth++;
+			str++;
+		}
+		else if (*str == '}' && --depth == 0) {
+			return str;
+		}
+	}
+	return end;
+}
+
+static void ref_expand(StrBuf *out, const char *str, const char *end)
+{
+	const char *close, *op, *val;
+	size_t n;
+
+	while (str < end) {
+		if (str + 1 < end && str[0] == '\\' && str[1] == '$') {
+			sb_append(out, "$", 1);
+			str += 2;
+		}
+		else if (str[0] != '$') {
+			sb_append(out, str++, 1);
+		}
+		else if (str + 1 < end && str[1] == '{') {
+			close = ref_close(str, end);
+			n = var_name_len(str + 2, close - str - 2);
+			op = str + 2 + n;
+			// Not something it knows, the $ is just text
+			if (close == end || n == 0 || !(op == close || op[0] == '-'
+				|| (op[0] == ':' && op[1] == '-'))) {
+				sb_append(out, str++, 1);
+				continue;
+			}
+
+			val = var_lookup(str + 2, n);
+			if (op < close && op[0] == ':' && (val == NULL || *val == '\0'))
+				ref_expand(out, op + 2, close);
+			else if (op < close && op[0] == '-' && val == NULL)
+				ref_expand(out, op + 1, close);
+			else if (val)
+				sb_append(out, val, strlen(val));
+			str = close + 1;
+		}
+		else if ((n = var_name_len(str + 1, end - str - 1)) > 0) {
+			if ((val = var_lookup(str + 1, n)) != NULL)
+				sb_append(out, val, strlen(val));
+			str += 1 + n;
+		}
+		else {
+			sb_append(out, str++, 1);
+		}
+	}
+}
+
+static void print_input(const char *str, size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		if (isprint((unsigned char) str[i]) && str[i] != '\\')
+			putchar(str[i]);
+		else
+			printf("\\x%02x", (unsigned char) str[i]);
+	}
+	putchar('\n');
+}
+
+int main(int argc, char **argv)
+{
+	long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+	unsigned seed = argc > 2 ? strtoul(argv[2], NULL, 10) : time(NULL);
+	StrBuf got = {0}, want = {0};
+	char *in = (char *) malloc(FUZZ_MAX_LEN);
+	char *big = (char *) malloc(4097);
+	size_t len;
+	long it;
+
+	// Only the variables below, so a seed gives the same run anywhere
+	environ = no_env;
+	vars_init();
+	var_set("A", "aa", 0);
+	var_set("E", "", 0);
+	var_set("X1_", "${A}$A", 0); // Values aren't expanded again
+	memset(big, 'L', 4096);
+	big[4096] = '\0';
+	var_set("L", big, 0); // Makes the output grow a lot at once
+	free(big);
+
+	srand(seed);
+	printf("seed %u\n", seed);
+	for (it = 0; it < iterations; it++) {
+		// Exactly as long as the input, so ASan catches reads past it
+		len = rand() % FUZZ_MAX_LEN;
+		in = (char *) realloc(in, len ? len : 1);
+		for (size_t i = 0; i < len; i++) {
+			if (rand() % 64 == 0)
+				in[i] = rand() % 256;
+			else
+				in[i] = fuzz_chars[rand() % (sizeof(fuzz_chars) - 1)];
+		}
+
+		got.len = want.len = 0;
+		expand_vars(&got, in, len);
+		ref_expand(&want, in, in + len);
+		if (got.len != want.len
+			|| (got.len > 0 && memcmp(got.data, want.data, got.len) != 0)) {
+			printf("mismatch at iteration %ld, input:\n", it);
+			print_input(in, len);
+			printf("got:\n");
+			print_input(got.data, got.len);
+			printf("want:\n");
+			print_input(want.data, want.len);
+			break;
+		}
+	}
+	if (it == iterations)
+		printf("%ld inputs ok\n", iterations);
+
+	free(in);
+	sb_free(&got);
+	sb_free(&want);
+	vars_free();
+	return it < iterations;
+}
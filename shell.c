@@ -8,27 +8,39 @@
 *		   James Henderson
 *
 * BUILD INSTRUCTIONS:
-*		gcc -lreadline -pthread -lpthread -o shelly shell.c
+*		gcc -pthread -lpthread -o shelly shell.c
 *
 * */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <fcntl.h>
 #include <ctype.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <spawn.h>
 #include <math.h>
 #include <signal.h>
 #include <termios.h>
+#include <stdint.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
 #include <threads.h>
-#include <readline/readline.h>
-#include <readline/history.h>
+#include <stdatomic.h>
 
 #include <dirent.h>
 #include <errno.h>
+#include <assert.h>
 
 #define MAXCOM 1000 // max number of letters to be supported
 #define MAXLIST 100 // max number of commands to be supported
@@ -36,9 +48,39 @@
 // Clearing the shell using escape sequences
 #define clear() printf("\033[H\033[J")
 #define HIST_FILEPATH "$HOME/.shelly-history"
+// Directories visited, for movetodir -j
+#define DIR_DB_FILEPATH "$HOME/.shelly-dirs"
+// Ranks are aged once they add up to this, and directories whose rank drops
+// below 1 are forgotten
+#define DIR_DB_MAX_RANK 9000
+#define HIST_MAGIC "SHLYHIST"
+#define HIST_VERSION 1
+#define HIST_INDEX_MIN 1024
+// Set to "text" to keep writing the legacy one-command-per-line history file
+#define ENV_HIST_FORMAT "SHELLY_HIST_FORMAT"
+// Number of finished commands to collect before writing them to the hist file
+#define ENV_HIST_BATCH "SHELLY_HIST_BATCH"
+// Set to 1 to fsync the hist file after every write
+#define ENV_HIST_FSYNC "SHELLY_HIST_FSYNC"
+#define HIST_BATCH_DEFAULT 16
+// Pending commands are written out once the oldest is this old, even if the
+// batch isn't full yet
+#define HIST_FLUSH_MAX_AGE_NS 2000000000LL
+// Most entries kept in memory and in the hist file, negative for no limit
+#define ENV_HIST_SIZE "HISTSIZE"
+#define ENV_HIST_FILE_SIZE "HISTFILESIZE"
+#define HIST_SIZE_DEFAULT 100000
+// Any of ignorespace, ignoredups, ignoreboth and erasedups, separated by ':'
+#define ENV_HIST_CONTROL "HISTCONTROL"
 #define DEFAULT_PROMPT "$PWD# "
 #define ENV_PROMPT "SHELLY_PROMPT"
+// $(cmd) in the prompt runs through this
+#define PROMPT_CMD_SHELL "/bin/sh"
 #define REPL_ENV_CHAR '{'
+// How processes are started: "spawn" (posix_spawn, default) or "fork"
+#define ENV_SPAWN "SHELLY_SPAWN"
+// Capacity in bytes to give the pipes between pipeline stages
+#define ENV_PIPE_SIZE "SHELLY_PIPE_SIZE"
 #define REPL_WS_CHAR '\\'
 // Using this for getcwd
 #define ARG_MAX_LEN 1024
@@ -57,42 +99,502 @@
 
 typedef struct Shell Shell;
 
-// This really should just be a linked-list... smh
-typedef char CmdArgv[ARG_MAX][ARG_MAX_LEN];
+// NULL terminated, points into the command's arena
+typedef char **CmdArgv;
 typedef int (*CmdFunc)(Shell*, CmdArgv, int);
 
+#define ARENA_CHUNK_SIZE (64 * 1024)
+
+typedef struct ArenaChunk ArenaChunk;
+struct ArenaChunk {
+	ArenaChunk *next;
+	size_t cap;
+	size_t used;
+	char data[];
+};
+
+// Bump allocator for everything a single command line needs. It is reset
+// once the command is done, and its chunks are kept and reused, so a command
+// normally doesn't malloc at all.
+typedef struct Arena Arena;
+struct Arena {
+	ArenaChunk *head;
+	ArenaChunk *cur;
+	long mallocs; // Chunks allocated over the life of the arena
+};
+
+// Growable, contiguous byte buffer
+typedef struct StrBuf StrBuf;
+struct StrBuf {
+	char *data;
+	size_t len;
+	size_t cap;
+};
+
+// Per-entry metadata kept alongside each history command
+typedef struct HistMeta HistMeta;
+struct HistMeta {
+	int64_t when; // Seconds since the epoch, 0 if unknown
+	int64_t dur_us;
+	int status;
+	const char *cwd;
+};
+
+// Where a history entry's command and cwd live inside the history arena
+typedef struct HistEntry HistEntry;
+struct HistEntry {
+	size_t off;
+	size_t len;
+	size_t cwd_off;
+	int64_t when;
+	int64_t dur_us;
+	int status;
+};
+
+// On-disk layout of the binary history file:
+//   header | records and index blocks, in append order
+// Records are appended at header.end. The index is an array of index_cap
+// absolute record offsets; when it fills up a twice as large copy is appended
+// and the header repointed, so a write never moves existing data. The header
+// is written last and is what makes appended records visible.
+typedef struct HistFileHeader HistFileHeader;
+struct HistFileHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t hdr_size;
+	uint64_t count;
+	uint64_t index_off;
+	uint64_t index_cap;
+	uint64_t end;
+	uint64_t reserved[2];
+};
+
+// Record header, followed by the null terminated cwd and then the null
+// terminated command, padded to 8 bytes
+typedef struct HistRecord HistRecord;
+struct HistRecord {
+	int64_t when;
+	int64_t dur_us;
+	int32_t status;
+	uint32_t cwd_len;
+	uint32_t cmd_len;
+	uint32_t reserved;
+};
+
+// History is an append-only string arena plus an offset/length index, so each
+// entry only costs its own length and lookups by number are O(1). Entries are
+// stored null terminated. Pointers from hist_get() are invalidated by the next
+// hist_push() since the arena may move.
+//
+// Entries loaded from a binary history file are not copied at all: the file is
+// mapped and entries [0, map_count) are read through its on-disk index on
+// demand. Entries added afterwards live in the arena.
 typedef struct CmdHist CmdHist;
 struct CmdHist {
-	CmdHist *next;
-	char cmd[CMD_MAX_LEN];
+	StrBuf arena;
+	HistEntry *ents;
+	int nents;
+	int cap;
+	int len; // map_count + nents
+
+	const char *map;
+	size_t map_size;
+	const uint64_t *map_index;
+	int map_count;
+
+	int binary; // Write records in the binary format
+	uint64_t text_lines; // Lines in a text hist file, as far as we know
+	int64_t start_ns; // When the newest entry started running
+
+	// Group commit: entries [flushed, len) are finished but not yet written.
+	// They are written in one go, under an exclusive flock, to a descriptor
+	// that stays open for the life of the shell.
+	int fd;
+	int flushed;
+	int batch;
+	int fsync;
+	int64_t pending_ns; // When the oldest unwritten entry finished
+
+	int loaded; // The file is only read once the history is needed
+	int running; // The newest entry hasn't finished yet
+	size_t arena_dead; // Bytes of erased entries still in the arena
+
+	// Rewrites the hist file down to HISTFILESIZE entries once it gets too big
+	thrd_t compactor;
+	int compactor_started;
+	atomic_int compacting;
   // Opted to re-parse for memory saving and simplicity
-  // CmdFunc func;
-  // CmdArgv vargs;
 };
 
-typedef struct IntList IntList;
-struct IntList {
-	int data;
-	IntList *next;
+// Trigram index for substring search over the history. Every trigram of an
+// entry maps to the list of entries containing it, stored as varint deltas
+// since entries only ever get added at the end. A search intersects the lists
+// for the pattern's trigrams and checks the few candidates left. Ids are
+// history numbers plus base, so dropping the oldest entries only moves base
+// and leaves ids below it in the lists until the next rebuild.
+typedef struct HistPosting {
+	uint32_t gram; // 0 for an empty slot, commands have no null bytes
+	int count;
+	int last; // Newest entry in the list
+	uint8_t *ids;
+	uint32_t len, cap;
+} HistPosting;
+
+typedef struct HistIndex {
+	HistPosting *slots;
+	int cap, num;
+	int indexed; // Ids [0, indexed) are in the index
+	int base; // Entries dropped from the front since it was built
+	int stale; // Entries were erased from the middle, rebuild it
+
+	// Candidates for the last pattern, so each ^R doesn't intersect again
+	char *pat;
+	int *cands;
+	int num_cands;
+	int cands_at; // What indexed was when they were worked out
+} HistIndex;
+
+enum JobState { JOB_FREE, JOB_RUNNING, JOB_STOPPED, JOB_DONE };
+
+// Resources used by a job or by foreground commands, summed up from wait4()
+typedef struct JobUsage {
+	int64_t user_us, sys_us;
+	long max_rss_kb; // The largest of the processes, not a sum
+	long ctx_switches; // Voluntary and involuntary
+} JobUsage;
+
+// A background pipeline. With pidfd support each of its processes' pidfds is
+// registered with the shell's epoll instance with the job's slot and the
+// stage as data, so an exit is handled without looking anything up.
+typedef struct Job Job;
+struct Job {
+	int id; // Slot + 1
+	enum JobState state;
+	pid_t pgid; // Each job gets its own process group
+	pid_t *pids; // 0 once reaped
+	int *pidfds; // -1 without pidfd support
+	int num_pids;
+	int left; // Not reaped yet
+	int status; // Exit code of the last stage
+	char *cmd;
+	int64_t start_ns, end_ns;
+	JobUsage usage;
+	int next_free;
+};
+
+// Where a background pid is in the job table
+typedef struct JobPid {
+	pid_t pid; // 0 for an empty slot
+	int job;
+	int stage;
+} JobPid;
+
+// How many finished jobs lsbg remembers
+#define JOB_DONE_MAX 16
+
+// Jobs live in slots that are handed out from a free list, and a pid hash
+// points back at them, so adding, finding and removing a job is O(1)
+typedef struct JobTable {
+	Job *jobs;
+	int cap;
+	int free_head; // -1 when every slot is taken
+	int num_running;
+	JobPid *pids; // Linear probing, cap is a power of two
+	int pid_cap;
+	int pid_count;
+	Job done[JOB_DONE_MAX]; // Ring of finished jobs, without pids
+	int done_next, num_done;
+	long num_finished; // Ever, the line editor redraws when it changes
+} JobTable;
+
+// pidfd_send_signal() flag for signalling the pid's process group (6.9+)
+#ifndef PIDFD_SIGNAL_PROCESS_GROUP
+#define PIDFD_SIGNAL_PROCESS_GROUP (1UL << 2)
+#endif
+
+// waitid() on a pidfd (5.4+)
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
+
+// Read size for the input buffers, large so scripts take few reads
+#define INPUT_BUF_SIZE (64 * 1024)
+// Buffer size for printing the history
+#define HIST_PRINT_CHUNK (64 * 1024)
+// Most completions kept (and listed) for one Tab
+#define COMPL_MAX_MATCHES 200
+// How many of the newest history entries are indexed for word completion
+#define COMPL_HIST_ENTRIES 2000
+// How deep `source` can nest (a file sourcing itself, say)
+#define SOURCE_MAX_DEPTH 64
+
+// SHELLY_PROMPT is split into these once, and again only when it's changed
+// with set. Variable values are kept up to date by set and movetodir.
+enum PromptSegKind { SEG_TEXT, SEG_VAR, SEG_CMD };
+
+typedef struct PromptSeg {
+	enum PromptSegKind kind;
+	char *text; // The literal text, variable name or command
+	char *value; // Variable value or last command output, NULL if none
+} PromptSeg;
+
+// The $(cmd) segments of one prompt, started by the shell and read to the end
+// on a thread of their own. Only that thread touches it until done is set.
+typedef struct PromptJob {
+	int num;
+	int *pidfds; // -1 when the kernel has none, the shell reaps those
+	int *fds; // Read end of each command's stdout
+	char **out;
+	int gen; // Prompt generation the commands came from
+	atomic_int done;
+} PromptJob;
+
+typedef struct Prompt {
+	PromptSeg *segs; // NULL until the first prompt
+	int num_segs;
+	int num_cmds;
+	int dirty;
+	int gen; // Bumped on every compile
+	StrBuf out; // The rendered prompt
+	PromptJob *job; // Commands still running, NULL if none
+} Prompt;
+
+// Prefix trie of completion candidates. Nodes live in one array and link to
+// each other by index (0, the root, doubles as "none"); siblings are kept in
+// byte order so matches come out sorted. A word can be added more than once
+// (the same program in two PATH directories) and removed again, nodes whose
+// words are all gone are skipped and reclaimed by trie_compact().
+typedef struct TrieNode {
+	int child, sibling;
+	int words; // Different words at or below this node
+	int ends; // Times the word ending here was added
+	char c;
+} TrieNode;
+
+typedef struct Trie {
+	TrieNode *nodes;
+	int num_nodes, cap;
+	int dead; // Nodes left with no words
+} Trie;
+
+// A PATH directory (or the directory being completed in) and the names that
+// came from it, null separated, so they can be taken out when it changes
+typedef struct ComplDir {
+	char *path;
+	struct timespec mtime;
+	StrBuf names;
+} ComplDir;
+
+// One kind of completion: builtins, programs on PATH, directory entries,
+// variable names or words from the history. refresh() brings trie up to date
+// and is cheap when nothing changed.
+typedef struct ComplSrc ComplSrc;
+struct ComplSrc {
+	Trie trie;
+	void (*refresh)(Shell *shelly, ComplSrc *src, const char *dir);
+	char *key; // The PATH or directory it was built for
+	ComplDir *dirs;
+	int num_dirs;
+	long seen; // Variable store version or history entries indexed
 };
 
+// What the word before the cursor is
+typedef struct ComplContext {
+	const char *word; // Start of the word, it ends at the cursor
+	size_t len;
+	int is_cmd; // The first word of a command or pipeline stage
+	const char *base; // Last part of a path (or the name after a $)
+	char *dir; // Directory to list for paths, NULL otherwise
+} ComplContext;
+
+// Tab completion. The sources are built the first time they're needed.
+typedef struct TabCompl {
+	ComplSrc builtins, path, files, vars, hist;
+	StrBuf matches; // Candidates for base, null separated, sorted, unique
+	int num_matches; // Found, kept ones are capped at COMPL_MAX_MATCHES
+	int num_kept;
+	StrBuf common; // What every match adds after base
+} TabCompl;
+
+// The line being typed at an interactive prompt
+typedef struct LineEdit {
+	StrBuf *line; // Not null terminated while editing
+	size_t pos; // Cursor, a byte offset into line
+	const char *prompt;
+	size_t prompt_cols;
+	int hist_idx; // History entry shown, -1 for the line being typed
+	char *typed; // The line being typed while browsing history
+	StrBuf out; // A redraw, written in one go
+} LineEdit;
+
+// Where commands are read from: stdin, a script or a sourced file
+typedef struct InputSrc {
+	int fd; // -1 when buf already holds all of it (-c)
+	int polled; // Registered with the epoll instance, only stdin can be
+	char *buf; // INPUT_BUF_SIZE
+	size_t pos, len;
+} InputSrc;
+// epoll data for the event sources, EV_JOB is never 1 or 2
+#define EV_INPUT 1
+#define EV_SIGCHLD 2
+#define EV_JOB(job, stage) (((uint64_t) (job) + 1) << 32 | (uint32_t) (stage))
+
+// A directory that has been visited. Its frecency is its rank (one per visit,
+// aged as the total grows) weighted by how recently it was last visited.
+typedef struct DirVisit {
+	char *path;
+	double rank;
+	int64_t when;
+	double added; // Rank gained in this shell, what's merged into the file
+} DirVisit;
+
+// The visited directories, loaded the first time the directory changes and
+// merged back into the file on exit as "rank<TAB>when<TAB>path" lines. There
+// are only as many as aging leaves (a few hundred), so they're kept in a
+// plain array.
+typedef struct DirDb {
+	DirVisit *ents;
+	int num, cap;
+	int loaded, dirty;
+	char **forgotten; // Gone directories, taken out of the file too
+	int num_forgotten;
+	char *filepath;
+} DirDb;
+
 struct Shell
 {
-	CmdHist *hist;
-	int hist_len;
+	CmdHist hist;
+	HistIndex hist_index; // Built the first time the history is searched
   char *hist_filepath;
-  char *cwd; // Current directory path
+  char *cwd; // Current directory path, canonical
+	int cwd_fd; // And an O_PATH descriptor for it, paths resolve against this
+	char **dir_stack; // pushd/popd, the top is the end
+	int dir_stack_len, dir_stack_cap;
+	DirDb dirs;
   // char mainDir[ARG_MAX_LEN];
   
   int infile, outfile, errfile;
-	IntList *bgpids;
+	JobTable jobs;
 	mtx_t bg_mtx;
-	int num_bgpids;
 	int is_running;
+	int last_status; // Exit code of the last foreground process
+	int exit_status; // Of the last command, what a script exits with
+	JobUsage fg_usage; // Every foreground process so far
+	int64_t fg_wall_ns;
+	Arena cmd_arena; // Reset after every command
+
+	// Child exits (pidfds, or a SIGCHLD signalfd on kernels without them)
+	// and input readiness all come through here
+	int epoll_fd;
+	int sigchld_fd; // Stops, and exits when there are no pidfds
+	int use_pidfd;
+	InputSrc main_input; // stdin
+	InputSrc *input; // What's being read right now
+	int source_depth;
+	// The line being run, as read and with variables expanded. Parsing copies
+	// it, so nested input (source) can reuse them.
+	StrBuf line, expanded;
+
+	Prompt prompt;
+	TabCompl compl;
+};
+
+// A bare command name resolved to the executable that PATH leads to
+typedef struct PathEntry PathEntry;
+struct PathEntry {
+	char *name;
+	char *path;
+	int dir; // Index of the PATH directory it was found in
+};
+
+// Like sh's `hash`: remembers where bare command names live so launching
+// doesn't search PATH again. Entries are dropped when PATH changes or when a
+// PATH directory at or before the one an entry came from is modified, since
+// that directory could now shadow it.
+typedef struct PathCache PathCache;
+struct PathCache {
+	char *path_env; // The PATH the cache was built for
+	char **dirs;
+	struct timespec *dir_mtimes;
+	int num_dirs;
+
+	PathEntry *slots; // Open addressing, cap is a power of two
+	int cap;
+	int count;
+};
+
+// A shell variable. Only exported ones are passed on to programs.
+typedef struct Var Var;
+struct Var {
+	char *name;
+	char *value;
+	int exported;
+};
+
+// Shell variables, seeded from the environment at startup. Lookups hash the
+// name instead of scanning environ, and the envp handed to programs is built
+// once and kept until an exported variable changes.
+typedef struct VarStore VarStore;
+struct VarStore {
+	Var *slots; // Open addressing, cap is a power of two
+	int cap;
+	int count;
+
+	char **envp; // NULL when it has to be rebuilt
+	StrBuf env_strs; // The NAME=value strings envp points into
+	long version; // Bumped when a variable is added
+};
+
+// Child descriptors 0 to REDIR_MAX_FD - 1 can be redirected
+#define REDIR_MAX_FD 10
+// Marks a child descriptor that should be closed (`n>&-`)
+#define REDIR_CLOSED -2
+
+enum RedirKind {
+	REDIR_IN,      // n< file
+	REDIR_OUT,     // n> file, truncates
+	REDIR_APPEND,  // n>> file
+	REDIR_DUP,     // n>&m, n<&m
+	REDIR_HERESTR, // n<<< word
+	REDIR_HEREDOC  // n<< delimiter, body on the following input lines
+};
+
+typedef struct Redir Redir;
+struct Redir {
+	Redir *next;
+	enum RedirKind kind;
+	int fd; // The child's descriptor
+	char *target; // File, word, or here-doc delimiter
+	int dup_fd; // REDIR_DUP: the descriptor to copy, or REDIR_CLOSED
+	StrBuf body; // REDIR_HEREDOC
+	int open_fd; // Set by open_redirs(), -1 until then
+};
 
-	char *prompt;
+// The `|` stages that follow the command in argv, e.g. for
+// `start gen | sort | uniq -c` argv is {"start", "gen"} and the stages are
+// {"sort"} and {"uniq", "-c"}. redirs[0] are the redirections of argv's
+// stage and redirs[i] those of stages[i - 1], in the order they were given.
+// Set by parse().
+typedef struct Pipeline Pipeline;
+struct Pipeline {
+	char ***stages;
+	Redir **redirs;
+	int num_stages;
 };
 
+// Replaced by the iteration number (from 1) in the arguments of `repeat`.
+// Type it as {I so it isn't expanded when the line is read.
+#define REPEAT_INDEX_VAR "$I"
+
+// An iteration of `repeat -j` that is still running
+typedef struct RepeatSlot {
+	pid_t *pids; // 0 once reaped
+	int num_pids;
+	int left; // Not reaped yet
+	int failed;
+	int busy_at; // Where it is in the list of running slots
+} RepeatSlot;
+
 typedef struct CmdDef {
 	char *cmd_name;
 	CmdFunc func;
@@ -102,22 +604,71 @@ typedef struct CmdDef {
 
 enum ParseStatus {
 	PARSE_OK=0, PARSE_INVALID_CHAR=1, PARSE_INVALID_CMD=2, 
-	PARSE_INVALID_PIPE, PARSE_INVALID_FILE};
+	PARSE_INVALID_PIPE, PARSE_INVALID_FILE, PARSE_INVALID_REDIR};
 
 void init_shell(Shell*, int);
 void exit_shell(Shell *shelly);
-void read_hist_file(Shell *shelly, FILE *hist_file);
-CmdHist* create_cmd_hist(char *cmd);
+void read_hist_file(Shell *shelly, int fd);
+void load_hist(Shell *shelly);
 void add_to_hist(Shell *shelly, char *buf);
-int parse(const CmdDef **cmd_def, CmdArgv argv, int *argc, char *cmd);
-void env_find_replace(char *dest, char *str);
+void finish_hist(Shell *shelly, int status);
+void flush_hist(Shell *shelly);
+void sb_reserve(StrBuf *sb, size_t extra);
+void sb_append(StrBuf *sb, const char *str, size_t len);
+void sb_free(StrBuf *sb);
+void hist_push(CmdHist *hist, const char *cmd, size_t len, const HistMeta *meta);
+const char* hist_get(CmdHist *hist, int i);
+int hist_get_meta(CmdHist *hist, int i, HistMeta *meta);
+void hist_free(CmdHist *hist);
+void hist_index_update(Shell *shelly);
+void hist_index_free(HistIndex *index);
+int hist_search(Shell *shelly, const char *pat, size_t len, int before, int *out, int max);
+int hist_file_rewrite(const char *path, CmdHist *hist, int first, int n);
+int hist_text_rewrite(const char *path, CmdHist *hist, int first, int n);
+int hist_file_append(int fd, CmdHist *hist, int first, int n);
+int64_t now_ns(void);
+void* arena_alloc(Arena *arena, size_t size);
+void arena_reset(Arena *arena);
+void arena_free(Arena *arena);
+int parse(Arena *arena, const CmdDef **cmd_def, CmdArgv *argv, int *argc, const char *cmd);
+size_t var_name_len(const char *p, size_t len);
+void expand_vars(StrBuf *out, const char *str, size_t len);
+const char* prompt_render(Shell *shelly);
+void prompt_changed(Shell *shelly, const char *name);
+void prompt_free(Prompt *prompt);
+int exit_code(int status);
+int launch_process(char **argv, int pgid, const int *fds, int foreground);
+int launch_pipeline(Shell *shell, char **argv, int pgid,
+	int infile, int outfile, int errfile, pid_t **pids);
+int open_redirs(void);
+void close_redirs(void);
+void read_heredocs(Shell *shelly);
+int wait_pipeline(pid_t *pids, int num_pids, int num_stages, JobUsage *usage);
+void usage_add(JobUsage *usage, const struct rusage *ru);
 void print_hist_list(Shell *shelly);
-void free_hist_ll(Shell *shelly);
+const char* path_lookup(const char *name);
+void path_cache_clear(PathCache *cache);
 
 void termination_handler(int signum);
-void child_term_handler(int signum);
-void add_bgpid(Shell *shelly, int pid);
-void remove_bgpid(Shell *shelly, int pid);
+void events_init(Shell *shelly);
+int wait_events(Shell *shelly, int timeout_ms);
+int shell_getc(Shell *shelly);
+ssize_t fill_input(Shell *shelly);
+int source_file(Shell *shelly, char *filepath);
+int edit_line(Shell *shelly, const char *prompt);
+int tab_complete(Shell *shelly, const char *line, size_t pos, ComplContext *ctx);
+void compl_free(TabCompl *compl);
+void run_input(Shell *shelly);
+void source_string(Shell *shelly, char *str);
+int run_line(Shell *shelly, char *cmd_buf);
+char* job_cmdline(char **argv, char ***stages, int num_stages);
+int add_job(Shell *shelly, pid_t *pids, int num_pids, char *cmd);
+Job* find_job(Shell *shelly, pid_t pid, int *stage);
+int reap_job(Shell *shelly, Job *job, int stage);
+int signal_job(Job *job, int sig);
+int signal_pid(pid_t pid, int sig);
+void watch_input(Shell *shelly, int on);
+void free_jobs(Shell *shelly);
 void kill_child(int pid);
 
 int print_bgpids(Shell *shelly, CmdArgv argv, int argc);
@@ -128,7 +679,6 @@ int movetodir(Shell *shelly, CmdArgv argv, int argc);
 int whereami(Shell *shelly, CmdArgv argv, int argc);
 int set_env(Shell *shell, CmdArgv argv, int argc);
 int history(Shell *shelly, CmdArgv argv, int argc);
-void history_rev(CmdHist *hist, int i);
 int byebye(Shell *shelly, CmdArgv argv, int argc);
 int replay(Shell *shelly, CmdArgv argv, int argc);
 int repeat(Shell *shelly, CmdArgv argv, int argc);
@@ -148,9 +698,33 @@ int shell_help(Shell *shell, CmdArgv argv, int argc);
 int set_env_help(Shell *shell, CmdArgv argv, int argc);
 int repeat_help(Shell *shelly, CmdArgv argv, int argc);
 int dalekall_help(Shell *shell, CmdArgv argv, int argc);
+int hash_cmd(Shell *shell, CmdArgv argv, int argc);
+int hash_cmd_help(Shell *shell, CmdArgv argv, int argc);
+int time_cmd(Shell *shell, CmdArgv argv, int argc);
+int time_cmd_help(Shell *shell, CmdArgv argv, int argc);
+int source_cmd(Shell *shell, CmdArgv argv, int argc);
+int source_cmd_help(Shell *shell, CmdArgv argv, int argc);
+int export_cmd(Shell *shell, CmdArgv argv, int argc);
+int export_cmd_help(Shell *shell, CmdArgv argv, int argc);
+int pushd(Shell *shell, CmdArgv argv, int argc);
+int pushd_help(Shell *shell, CmdArgv argv, int argc);
+int popd(Shell *shell, CmdArgv argv, int argc);
+int popd_help(Shell *shell, CmdArgv argv, int argc);
+void dir_db_save(Shell *shelly);
+void dir_db_free(DirDb *db);
+void vars_init(void);
+void vars_free(void);
+const char* var_lookup(const char *name, size_t len);
+const char* var_get(const char *name);
+void var_set(const char *name, const char *value, int export);
+char** var_envp(void);
+
+extern char **environ;
 
 Shell *root_shell = NULL;
-int pipe_to = -1;
+PathCache path_cache;
+VarStore vars;
+Pipeline pipeline;
 pid_t shell_pgid;
 struct termios shell_tmodes;
 int shell_terminal;
@@ -175,9 +749,31 @@ const CmdDef builtin_cmds[] = {
 	{"exit", shell_exit, NULL},
 	{"lsbg", print_bgpids, print_bgpids_help},
 	{"help", shell_help, NULL},
+	{"hash", hash_cmd, hash_cmd_help},
+	{"time", time_cmd, time_cmd_help},
+	{"source", source_cmd, source_cmd_help},
+	{"export", export_cmd, export_cmd_help},
+	{"pushd", pushd, pushd_help},
+	{"popd", popd, popd_help},
 	{NULL, NULL, NULL}
 };
 
+// Perfect hash over the names in builtin_cmds: every builtin gets its own
+// slot, so dispatch is one hash and one strcmp. The multipliers and the slot
+// table were found offline by brute force; redo them when adding a builtin,
+// builtin_slots_check() stops the shell at startup if they're out of date.
+#define BUILTIN_HASH_SIZE 64
+#define BUILTIN_HASH(name, len) \
+	(((unsigned char) (name)[0] + (unsigned char) (name)[(len) - 1] * 3 + (len) * 12) \
+	 & (BUILTIN_HASH_SIZE - 1))
+
+static const signed char builtin_slots[BUILTIN_HASH_SIZE] = {
+	-1, -1, -1, 11, -1, -1,  6, -1,  9, 19, -1,  5, 21, -1, -1, -1,
+	16, 14,  1, 17, -1, -1,  7, -1, 20,  3, -1, -1, -1, -1, -1, 10,
+	-1,  8, -1, -1, -1,  4, -1,  2, 15, -1, 18, -1, -1, -1, -1,  0,
+	-1, 13, -1, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+};
+
 static const char *greetings[] = {
 	"The shell to end all shells\n"
 	"... I hope I don't break anything...\n"
@@ -192,561 +788,4113 @@ static const char *greetings[] = {
 	NULL
 };
 
+// Every builtin has to be in the slot its name hashes to, or it can't be run
+static void builtin_slots_check(void)
+{
+	const char *name;
+
+	for (int i = 0; (name = builtin_cmds[i].cmd_name) != NULL; i++)
+		assert(builtin_slots[BUILTIN_HASH(name, strlen(name))] == i);
+}
+
 const CmdDef* parse_cmd(char *cmd_name)
 {
-	CmdDef bi_cmd;		
-	int i = 0;
+	size_t len = strlen(cmd_name);
+	int i;
 
-	while ((bi_cmd = builtin_cmds[i]).cmd_name != NULL) {
-		if (strcmp(bi_cmd.cmd_name, cmd_name) == 0)
-			return builtin_cmds + i;
+	if (len == 0)
+		return NULL;
 
-		i++;
-	}
+	i = builtin_slots[BUILTIN_HASH(cmd_name, len)];
+	if (i >= 0 && strcmp(builtin_cmds[i].cmd_name, cmd_name) == 0)
+		return builtin_cmds + i;
 	
 	return NULL;
 }
 
-// cmd is a null or \n terminated string
-int parse(const CmdDef **cmd_def, CmdArgv argv, int *argc, char *cmd)
+static uint32_t hash_str(const char *str)
 {
-	int arg = 0;
-	int arg_len = 0;
-	int parsing_arg = 0;
-	int parsing_fpipe = 0;
-	char filepath[ARG_MAX_LEN];
-	int reached_end = 0;
-	char c;
-	int i;
-	pipe_to = -1;
-	
-	for (i = 0; i < ARG_MAX_LEN; i++) {
-		c = cmd[i];
-
-		if (c == '\0' || c == '\n')	
-			reached_end = 1;	/* Need to finish parsing arg */
-		
-		if (c == '>') {
-			parsing_fpipe = 1;
-			parsing_arg = 0;
-			// printf("parsing pipe\n");
-			continue;
-		}
-
-		if (IS_WHITESPACE(c) || reached_end) {
-			if (parsing_fpipe && reached_end) 
-				break;
-
-			// Done parsing arg
-			if (parsing_arg) {
-				argv[arg][arg_len] = '\0';
-				// printf("parsed argv: '%s'\n", argv[arg]);
+	// FNV-1a
+	uint32_t h = 2166136261u;
+	while (*str)
+		h = (h ^ (unsigned char) *str++) * 16777619u;
+	return h;
+}
 
-				if (arg == 0) {
-					const CmdDef* cd = parse_cmd(argv[0]);
-					if (cd == NULL)
-						return PARSE_INVALID_CMD;
+static uint32_t hash_mem(const char *mem, size_t len)
+{
+	uint32_t h = 2166136261u;
+	while (len--)
+		h = (h ^ (unsigned char) *mem++) * 16777619u;
+	return h;
+}
 
-					*cmd_def = cd;
-				}
-				parsing_arg = 0;
-				arg_len = 0;
-				arg++;
-			}	
+static int stat_mtime(const char *path, struct timespec *mtime)
+{
+	struct stat st;
 
-			if (reached_end)
-				break;
-		}
-		else if (IS_ALLOWED(c)) {
-			parsing_arg = 1;
-			if (c == REPL_ENV_CHAR)
-				c = '$';
-			else if (c == REPL_WS_CHAR)
-				c = ' ';
-			if (parsing_fpipe)
-				filepath[arg_len] = c;
-			else 
-				argv[arg][arg_len] = c;
-			arg_len++;
-		}
-		else {
-			return PARSE_INVALID_CHAR;
-		}
+	if (stat(path, &st) < 0) {
+		mtime->tv_sec = mtime->tv_nsec = 0;
+		return -1;
 	}
+	*mtime = st.st_mtim;
+	return 0;
+}
 
-	*argc = arg;
-	// printf("last arg len: %d\n", arg_len);
-
-	if (parsing_fpipe) {
-		if (arg_len <= 0)
-			return PARSE_INVALID_PIPE;
-		else {
-			filepath[arg_len] = '\0';
-			// printf("filepath: '%s'\n", filepath);
-			pipe_to = open(filepath, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
-			if (pipe_to < 0)
-				return PARSE_INVALID_FILE;
-		}
+static void path_cache_flush(PathCache *cache)
+{
+	for (int i = 0; i < cache->cap; i++) {
+		free(cache->slots[i].name);
+		free(cache->slots[i].path);
 	}
-
-	return PARSE_OK;
+	memset(cache->slots, 0, sizeof(PathEntry) * cache->cap);
+	cache->count = 0;
 }
 
-void source_file(Shell *shelly, char *filepath)
+void path_cache_clear(PathCache *cache)
 {
-	
+	path_cache_flush(cache);
+	free(cache->slots);
+	for (int i = 0; i < cache->num_dirs; i++)
+		free(cache->dirs[i]);
+	free(cache->dirs);
+	free(cache->dir_mtimes);
+	free(cache->path_env);
+	memset(cache, 0, sizeof(*cache));
 }
 
-
-
-int launch_process(char **argv, int argc, 
-  int pgid, int infile, int outfile, int errfile, int foreground)
+// Rebuilds the directory list for a new PATH, dropping every entry
+static void path_cache_set_path(PathCache *cache, const char *path_env)
 {
-
-  // Forking a child
-  pid_t pid = fork(); 
-
-  if (pid == -1) {
-    printf("\nFailed forking child..");
-    return -1;
-  } else if (pid == 0) {
-    pid = getpid ();
-    if (pgid == 0) pgid = pid;
-      setpgid (pid, pgid);
-
-    if (infile != STDIN_FILENO) {
-      dup2(infile, STDIN_FILENO);
-      close(infile);
-    }
-    if (outfile != STDOUT_FILENO) {
-      dup2(outfile, STDOUT_FILENO);
-      close(outfile);
-    }
-    if (infile != STDERR_FILENO) {
-      dup2(errfile, STDERR_FILENO);
-      close(errfile);
-    }
-
-    if (execvp(argv[0], argv) < 0) {
-      switch (errno) {
-        case EACCES:
-          printf("Access denied.\n");
-          break;
-        case EIO:
-          printf("An I/O error has occured.\n");
-          break;
-        case ENOENT:
-          printf("Does not exist.\n");
-          break;
-        default:
-          printf("An error has occured (%d)\n", errno);
-          break;
-      }
-    }
-    exit(1);
-  } else {
-    // waiting for child to terminate
-		if (foreground) {
-			wait(NULL); 
-			return 0;
-		}
-		else {
-			return pid;
-		}
-  }
+	const char *dir = path_env, *end;
+
+	path_cache_clear(cache);
+	cache->path_env = strdup(path_env);
+	cache->cap = 64;
+	cache->slots = (PathEntry *) calloc(cache->cap, sizeof(PathEntry));
+
+	while (1) {
+		end = strchr(dir, ':');
+		if (end == NULL)
+			end = dir + strlen(dir);
+
+		cache->dirs = (char **) realloc(cache->dirs, sizeof(char *) * (cache->num_dirs + 1));
+		cache->dir_mtimes = (struct timespec *) realloc(
+			cache->dir_mtimes, sizeof(struct timespec) * (cache->num_dirs + 1));
+		// An empty PATH element means the current directory
+		cache->dirs[cache->num_dirs] = end == dir ? strdup(".") : strndup(dir, end - dir);
+		stat_mtime(cache->dirs[cache->num_dirs], cache->dir_mtimes + cache->num_dirs);
+		cache->num_dirs++;
+
+		if (*end == '\0')
+			break;
+		dir = end + 1;
+	}
 }
 
-void env_find_replace(char *dest, char *str)
-{
-	int front = 0;
-	int back = 0;
-	char key[ARG_MAX_LEN];
-	char *val;
-	char c = str[0];
-	int in_key = 0;
-
-	// Need to check if in_key=true and c=='\0' to cover the edge case where the
-	// env var is at the end of the string.
-	while ((c != '\0' || in_key) && back < ARG_MAX_LEN) {
-		if (c == '$')	{
-			in_key = 1;
-			back++;
-			front++;
-			c = str[front];
-		}
-		else if (in_key) {
-			if (isalpha(c) || c == '_') {
-				front++;
-				c = str[front];
-			}
-			else {
-				// check env
-				memcpy((void*) key, (void*) (str + back), front - back);
-				key[front - back] = '\0';
-				// printf("key:'%s', strlen=%d\n", key, strlen(key));
-				val = getenv(key);
-				// printf("val:'%s'\n", val);
-				if (val) {
-					while (*val != '\0') {
-						*dest = *val;
-						val++;
-						dest++;
-					}
-					back = front;
-				}
-				else {
-					for (; back <= front; back++) {
-						*dest = str[back];
-					}
-				}
-
-				in_key = 0;
-			}
-		}
-		else {
-			*dest = c;
-			dest++;
-			front++;
-			back++;
-			c = str[front];
+// Checks directories [0, up_to] for modifications. Returns 1 (after dropping
+// all entries) if any changed.
+static int path_cache_stale(PathCache *cache, int up_to)
+{
+	struct timespec mtime;
+	int stale = 0;
+
+	for (int i = 0; i <= up_to && i < cache->num_dirs; i++) {
+		stat_mtime(cache->dirs[i], &mtime);
+		if (mtime.tv_sec != cache->dir_mtimes[i].tv_sec
+			|| mtime.tv_nsec != cache->dir_mtimes[i].tv_nsec) {
+			cache->dir_mtimes[i] = mtime;
+			stale = 1;
 		}
-
-		// printf("front=%d, back=%d\n", front, back);
 	}
 
-	*dest = '\0';
+	if (stale)
+		path_cache_flush(cache);
+	return stale;
 }
 
+static void path_cache_insert(PathCache *cache, const char *name, char *path, int dir)
+{
+	uint32_t i;
+
+	if ((cache->count + 1) * 2 > cache->cap) {
+		PathEntry *old = cache->slots;
+		int old_cap = cache->cap;
+
+		cache->cap *= 2;
+		cache->slots = (PathEntry *) calloc(cache->cap, sizeof(PathEntry));
+		for (int j = 0; j < old_cap; j++) {
+			if (old[j].name == NULL)
+				continue;
+			i = hash_str(old[j].name) & (cache->cap - 1);
+			while (cache->slots[i].name)
+				i = (i + 1) & (cache->cap - 1);
+			cache->slots[i] = old[j];
+		}
+		free(old);
+	}
 
-const char* get_random_greeting() {
-	int len = 0;	
-
-	while (greetings[len] != NULL)
-		len++;
-	
-	return greetings[rand() % len];	
+	i = hash_str(name) & (cache->cap - 1);
+	while (cache->slots[i].name)
+		i = (i + 1) & (cache->cap - 1);
+	cache->slots[i].name = strdup(name);
+	cache->slots[i].path = path;
+	cache->slots[i].dir = dir;
+	cache->count++;
 }
 
-void init_shell(Shell *shelly, int is_interactive) {
-	char *hist_filepath = (char *) malloc(sizeof(char) * ARG_MAX_LEN);
-	FILE *hist_file;
-	shelly->hist_len = 0;
-
-	env_find_replace(hist_filepath, HIST_FILEPATH);
-  shelly->hist_filepath = hist_filepath;
-  shelly->hist = NULL;
-	// printf("%s\n", hist_filepath);
-  hist_file = fopen(hist_filepath, "r");
-	if (hist_file) {
-		read_hist_file(shelly, hist_file);
-    fclose(hist_file);
+// Resolves a command name to the executable execve() should run, the way
+// execvp() would. Names with a '/' are used as is. Returns NULL if it isn't
+// found on PATH.
+const char* path_lookup(const char *name)
+{
+	PathCache *cache = &path_cache;
+	const char *path_env = var_get("PATH");
+	struct stat st;
+	char *path;
+	uint32_t i;
+
+	if (strchr(name, '/'))
+		return name;
+
+	if (path_env == NULL)
+		path_env = "/usr/local/bin:/usr/bin:/bin";
+	if (cache->path_env == NULL || strcmp(cache->path_env, path_env) != 0)
+		path_cache_set_path(cache, path_env);
+
+	i = hash_str(name) & (cache->cap - 1);
+	while (cache->slots[i].name) {
+		if (strcmp(cache->slots[i].name, name) == 0) {
+			if (!path_cache_stale(cache, cache->slots[i].dir))
+				return cache->slots[i].path;
+			break;
+		}
+		i = (i + 1) & (cache->cap - 1);
 	}
 
-	shelly->cwd = getcwd(NULL, 0);
-	shelly->is_running = 1;
-	shelly->bgpids = NULL;
-	shelly->num_bgpids = 0;
-	if (mtx_init(&(shelly->bg_mtx), mtx_plain) != thrd_success) {
-		printf("Unable to create mutex for bg job list!\n");
-		exit(1);
+	for (int d = 0; d < cache->num_dirs; d++) {
+		path = (char *) malloc(strlen(cache->dirs[d]) + strlen(name) + 2);
+		sprintf(path, "%s/%s", cache->dirs[d], name);
+		if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, X_OK) == 0) {
+			path_cache_insert(cache, name, path, d);
+			return path;
+		}
+		free(path);
 	}
 
-	// if (is_interactive) {
-	// 	root_shell = shelly;
-	// 	signal(SIGTERM, termination_handler);
-	// 	signal(SIGINT, SIG_IGN);
-	// }
-
-  /* See if we are running interactively.  */
-  shell_terminal = STDIN_FILENO;
-  shell_is_interactive = isatty (shell_terminal);
-
-  if (shell_is_interactive) {
-		root_shell = shelly;
-    /* Loop until we are in the foreground.  */
-    while (tcgetpgrp (shell_terminal) != (shell_pgid = getpgrp ()))
-      kill (- shell_pgid, SIGTTIN);
-
-    /* Ignore interactive and job-control signals.  */
-    signal(SIGINT, SIG_IGN);
-    signal(SIGQUIT, SIG_IGN);
-    signal(SIGTSTP, SIG_IGN);
-    signal(SIGTTIN, SIG_IGN);
-    signal(SIGTTOU, SIG_IGN);
-    signal(SIGCHLD, child_term_handler);
-
-    /* Put ourselves in our own process group.  */
-    shell_pgid = getpid ();
-    if (setpgid (shell_pgid, shell_pgid) < 0)
-      {
-        perror ("Couldn't put the shell in its own process group");
-        exit (1);
-      }
-
-    /* Grab control of the terminal.  */
-    tcsetpgrp (shell_terminal, shell_pgid);
-
-    /* Save default terminal attributes for shell.  */
-    tcgetattr (shell_terminal, &shell_tmodes);
-  }
-
-  shelly->infile = STDIN_FILENO;
-  shelly->outfile = STDOUT_FILENO;
-  shelly->errfile = STDERR_FILENO;
-
-	char *prompt = getenv(ENV_PROMPT);
-	if (!prompt) {
-		setenv(ENV_PROMPT, DEFAULT_PROMPT, 1);
-	}
+	return NULL;
 }
 
-void free_hist_ll(Shell *shelly)
+int hash_cmd(Shell *shell, CmdArgv argv, int argc)
 {
-	CmdHist *hist = shelly->hist, *temp;
-	while (hist != NULL) {
-		temp = hist->next;
-		free(hist);
-		hist = temp;
+	if (argc == 2 && strcmp(argv[1], "-r") == 0) {
+		path_cache_clear(&path_cache);
+		return 0;
+	}
+	else if (argc != 1) {
+		return 1;
 	}
 
-	shelly->hist = NULL;
+	for (int i = 0; i < path_cache.cap; i++) {
+		if (path_cache.slots[i].name)
+			printf("%s=%s\n", path_cache.slots[i].name, path_cache.slots[i].path);
+	}
+	return 0;
 }
 
-void exit_shell(Shell *shelly)
+int hash_cmd_help(Shell *shell, CmdArgv argv, int argc)
 {
-  free(shelly->cwd);
-  free(shelly->hist_filepath);
-
-	free_hist_ll(shelly);
+	printf("hash [-r]                    list remembered program locations\n"
+				 "                             -r to forget them\n");
+	return 0;
+}
 
-	IntList *bgpid = shelly->bgpids, *temp_bgpid;
+// Slot of the variable called name (len bytes), or of the empty slot it
+// would go in
+static int var_slot(const char *name, size_t len)
+{
+	uint32_t i = hash_mem(name, len) & (vars.cap - 1);
 
-	// Just let the children finish I guess 
-	while (bgpid != NULL) {
-		temp_bgpid = bgpid->next;
-		free(bgpid);
-		bgpid = temp_bgpid;
+	while (vars.slots[i].name) {
+		if (strncmp(vars.slots[i].name, name, len) == 0 && vars.slots[i].name[len] == '\0')
+			break;
+		i = (i + 1) & (vars.cap - 1);
 	}
+	return i;
 }
-  
-  
-// Must be null terminated
-CmdHist* create_cmd_hist(char *cmd)
+
+// Copies every variable in environ, all of them exported
+void vars_init(void)
 {
-	CmdHist *hist = (CmdHist *)	malloc(sizeof(CmdHist));
-	hist->next = NULL;
-	strcpy(hist->cmd, cmd);
+	char *eq;
+
+	vars.cap = 64;
+	vars.slots = (Var *) calloc(vars.cap, sizeof(Var));
+	vars.count = 0;
+	vars.envp = NULL;
+	memset(&vars.env_strs, 0, sizeof(vars.env_strs));
 
-	return hist;
+	for (char **env = environ; *env; env++) {
+		if ((eq = strchr(*env, '=')) == NULL)
+			continue;
+		*eq = '\0';
+		var_set(*env, eq + 1, 1);
+		*eq = '=';
+	}
 }
 
-void read_hist_file(Shell *shelly, FILE *hist_file)
+void vars_free(void)
 {
-	char c;
-	int i = 0;
-	char cmd[CMD_MAX_LEN];
-	CmdHist *read_hist;
-
-  // printf("shelly hist:%p\n", shelly->hist);
-	while ((c=fgetc(hist_file)) != EOF) {
-		//shelly->cmdHist[1] = c;
-		if (c != '\n' && c != '\r')
-			cmd[i++] = c;
-		else if (i > 0) {
-			cmd[i] = '\0';
-      // printf("'%s'\n", cmd);
-			read_hist = create_cmd_hist(cmd);
-			read_hist->next = shelly->hist;
-			shelly->hist = read_hist;
-			shelly->hist_len++;
-			i = 0;
-		}
+	for (int i = 0; i < vars.cap; i++) {
+		free(vars.slots[i].name);
+		free(vars.slots[i].value);
 	}
+	free(vars.slots);
+	free(vars.envp);
+	sb_free(&vars.env_strs);
+	memset(&vars, 0, sizeof(vars));
 }
 
-void add_to_hist(Shell *shelly, char *buf)
+// The value of the variable called name (len bytes, not necessarily null
+// terminated), NULL if it isn't set
+const char* var_lookup(const char *name, size_t len)
 {
-	// Add to shelly hist list
-	CmdHist *hist = create_cmd_hist(buf);
-	hist->next = shelly->hist;
-	shelly->hist = hist;
-	shelly->hist_len++;
-
-	// Write to hist file
-  FILE *hist_file = fopen(shelly->hist_filepath, "a+");
-	if (hist_file) {
-		fprintf(hist_file, "%s\n", buf);
-    fclose(hist_file);
-  }
+	if (vars.cap == 0)
+		return NULL;
+	return vars.slots[var_slot(name, len)].value;
 }
 
-// TODO: if we have time
-// Idea is to create a TabCompl struct that contains ComplSrc structs and a
-// ComplContext struct. The ComplSrc provide the autocomplete options while the
-// ComplContext struct contains the context (like compl for command, directory,
-// etc).
-int tab_complete(char **results, char *buf)
+const char* var_get(const char *name)
 {
-	return 0;	
+	return var_lookup(name, strlen(name));
 }
 
-
-// Function to take input
-int take_input(Shell* shelly, char* str)
+// Sets name to value. With export it's also passed on to programs from now
+// on, otherwise a new variable is local to the shell and an existing one
+// keeps its export flag.
+void var_set(const char *name, const char *value, int export)
 {
-	char c;
-	int i = 0;
-	char buf[CMD_MAX_LEN];
-	char buf_env[CMD_MAX_LEN];
-
-	// printf("ti: '%s'\n", getenv(ENV_PROMPT));
-	// printf("pwd: '%s'\n", getenv("PWD"));
-	env_find_replace(buf_env, getenv(ENV_PROMPT));
-	printf("%s", buf_env);
-	while ((c = getchar()) != '\n') {
-		if (c == '\t') {
-	
-		}	
-		else {
-			buf[i] = c;
-			i++;
-		}
+	size_t len = strlen(name);
+	char *copy;
+	Var *var;
+	int i;
 
-		if (i >= CMD_MAX_LEN - 1) {
-			printf("Command too long!\n");
-			return 1;
+	if ((vars.count + 1) * 2 > vars.cap) {
+		Var *old = vars.slots;
+		int old_cap = vars.cap;
+
+		vars.cap *= 2;
+		vars.slots = (Var *) calloc(vars.cap, sizeof(Var));
+		for (int j = 0; j < old_cap; j++) {
+			if (old[j].name == NULL)
+				continue;
+			i = hash_str(old[j].name) & (vars.cap - 1);
+			while (vars.slots[i].name)
+				i = (i + 1) & (vars.cap - 1);
+			vars.slots[i] = old[j];
 		}
+		free(old);
 	}
 
-	buf[i] = '\0';
-	
-	if (strlen(buf) == 0)
-		return 1;
-
-	env_find_replace(buf_env, buf);
-  add_to_hist(shelly, buf);
-	strcpy(str, buf_env);
-	return 0;
+	var = vars.slots + var_slot(name, len);
+	if (var->name == NULL) {
+		var->name = strdup(name);
+		vars.count++;
+		vars.version++;
+	}
+	else if (strcmp(var->value, value) == 0 && (var->exported || !export)) {
+		return;
+	}
+	// value may be (or point into) the old value, as with export FOO, so copy
+	// it before freeing
+	if (value != var->value) {
+		copy = strdup(value);
+		free(var->value);
+		var->value = copy;
+	}
+	var->exported |= export;
 
-	// buf = readline("\n>>> ");
-	// if (strlen(buf) != 0) {
-	// 	add_to_hist(shelly, buf);
-	// 	env_find_replace(buf_env, buf);
-	// 	strcpy(str, buf_env);
-	//
-	// 	return 0;
-	// }
-	// else {
-	// 	return 1;
-	// }
+	if (var->exported) {
+		free(vars.envp);
+		vars.envp = NULL;
+	}
 }
 
-int repeat(Shell *shell, CmdArgv argv, int argc)
+// The environment for programs: every exported variable as NAME=value. Kept
+// until an exported variable changes.
+char** var_envp(void)
 {
-	if (argc < 3)
-		return 1;
-
-	int repeat_count = strtol(argv[1], NULL, 10);
-  int dev_null = open("/dev/null", O_WRONLY);
-	int pid;
-	int infile = dev_null;
-	int outfile = (pipe_to < 0) ? shell->outfile : pipe_to;
-	int errfile = (pipe_to < 0) ? shell->errfile : pipe_to;
-
-  char **process_args = (char **) malloc(sizeof(char *) * (argc + 1)); 
-  int i;
-  for (i = 0; i < argc - 2; i++) {
-    process_args[i] = argv[i + 2];
-		// printf("proc args[%d]=%s\n", i, process_args[i]);
-  }
-  process_args[i] = NULL;
-
-	for (i = 0; i < repeat_count; i++) {
-	 if (mtx_lock(&shell->bg_mtx) != thrd_success) {
-			printf("Unable to get lock on bg job list!\n");
-			exit(1);
-		}
+	Var *var;
+	int n = 0;
 
-		// printf("outfile: %d\n", outfile);
-		pid = launch_process(
-			process_args, argc, shell_pgid, infile, outfile, errfile, 0
-		);
+	if (vars.envp)
+		return vars.envp;
 
-		add_bgpid(shell, pid);
-		mtx_unlock(&shell->bg_mtx);
-		printf("pid: %d\n", pid);
+	vars.env_strs.len = 0;
+	for (int i = 0; i < vars.cap; i++) {
+		var = vars.slots + i;
+		if (var->name == NULL || !var->exported)
+			continue;
+		sb_append(&vars.env_strs, var->name, strlen(var->name));
+		sb_append(&vars.env_strs, "=", 1);
+		sb_append(&vars.env_strs, var->value, strlen(var->value) + 1);
+		n++;
 	}
 
-	close(dev_null);
-	free(process_args);
-	return 0;
+	// Pointers last, the strings may have moved while growing
+	vars.envp = (char **) malloc(sizeof(char *) * (n + 1));
+	for (size_t off = 0, k = 0; k < (size_t) n; k++) {
+		vars.envp[k] = vars.env_strs.data + off;
+		off += strlen(vars.envp[k]) + 1;
+	}
+	vars.envp[n] = NULL;
+	return vars.envp;
 }
 
-int repeat_help(Shell *shell, CmdArgv argv, int argc)
+int export_cmd(Shell *shell, CmdArgv argv, int argc)
 {
-	printf("repeat <n> <command>         repeat <command> <n> times\n");
-	return 0;
-}
+	const char *val;
 
-int start(Shell *shell, CmdArgv argv, int argc)
-{
-	int infile = shell->infile;
-	int outfile = (pipe_to < 0) ? shell->outfile : pipe_to;
-	int errfile = (pipe_to < 0) ? shell->errfile : pipe_to;
-  char **process_args = (char **) malloc(sizeof(char *) * (argc + 1)); 
-  int i;
-  for (i = 0; i < argc - 1; i++) {
-    process_args[i] = argv[i + 1];
-  }
-  process_args[i] = NULL;
+	if (argc > 3)
+		return 1;
 
-  launch_process(
-		process_args, argc, shell_pgid, 
-		infile, outfile, errfile, 1
-	);
-	free(process_args);
+	if (argc == 1) {
+		for (int i = 0; i < vars.cap; i++) {
+			if (vars.slots[i].name && vars.slots[i].exported)
+				printf("%s=%s\n", vars.slots[i].name, vars.slots[i].value);
+		}
+		return 0;
+	}
 
+	if (argc == 3)
+		val = argv[2];
+	else if ((val = var_get(argv[1])) == NULL)
+		val = "";
+	var_set(argv[1], val, 1);
+	prompt_changed(shell, argv[1]);
 	return 0;
 }
 
-int start_help(Shell *shell, CmdArgv argv, int argc)
+int export_cmd_help(Shell *shell, CmdArgv argv, int argc)
 {
-  printf("start <program> [param]      start a program\n");	
+	printf("export [<key> [value]]       pass a variable on to programs\n");
 	return 0;
 }
 
-
-int background(Shell *shell, CmdArgv argv, int argc)
+void* arena_alloc(Arena *arena, size_t size)
 {
-  int dev_null = open("/dev/null", O_WRONLY);
-	int pid;
-	int infile = dev_null;
-	int outfile = (pipe_to < 0) ? shell->outfile : pipe_to;
-	int errfile = (pipe_to < 0) ? shell->errfile : pipe_to;
+	ArenaChunk *chunk = arena->cur;
+	void *mem;
 
-  char **process_args = (char **) malloc(sizeof(char *) * (argc + 1)); 
-  int i;
-  for (i = 0; i < argc - 1; i++) {
-    process_args[i] = argv[i + 1];
-  }
-  process_args[i] = NULL;
+	size = (size + 15) & ~(size_t) 15;
+
+	// Move on to the next chunk (left over from before a reset) if needed
+	while (chunk == NULL || chunk->used + size > chunk->cap) {
+		if (chunk && chunk->next && chunk->next->cap >= size) {
+			chunk = chunk->next;
+			chunk->used = 0;
+			continue;
+		}
+
+		ArenaChunk *new_chunk = (ArenaChunk *) malloc(
+			sizeof(ArenaChunk) + (size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE));
+		if (new_chunk == NULL) {
+			printf("Out of memory!\n");
+			exit(1);
+		}
+		new_chunk->cap = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+		new_chunk->used = 0;
+		if (chunk) {
+			new_chunk->next = chunk->next;
+			chunk->next = new_chunk;
+		}
+		else {
+			new_chunk->next = arena->head;
+			arena->head = new_chunk;
+		}
+		arena->mallocs++;
+		chunk = new_chunk;
+	}
+
+	arena->cur = chunk;
+	mem = chunk->data + chunk->used;
+	chunk->used += size;
+	return mem;
+}
+
+void arena_reset(Arena *arena)
+{
+	arena->cur = arena->head;
+	if (arena->head)
+		arena->head->used = 0;
+}
+
+void arena_free(Arena *arena)
+{
+	ArenaChunk *chunk = arena->head, *next;
+
+	while (chunk) {
+		next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+	arena->head = arena->cur = NULL;
+}
+
+// Adds one pointer to a growing NULL separated list of args
+static void push_arg(Arena *arena, char ***args, int *arg, int *arg_cap, char *tok)
+{
+	char **grown;
+
+	// Keep room for the NULL at the end
+	if (*arg + 1 >= *arg_cap) {
+		grown = (char **) arena_alloc(arena, sizeof(char *) * *arg_cap * 2);
+		memcpy(grown, *args, sizeof(char *) * *arg);
+		*args = grown;
+		*arg_cap *= 2;
+	}
+	(*args)[(*arg)++] = tok;
+}
+
+static int is_number(const char *str)
+{
+	if (*str == '\0')
+		return 0;
+	for (; *str; str++) {
+		if (!isdigit((unsigned char) *str))
+			return 0;
+	}
+	return 1;
+}
+
+// cmd is a null or \n terminated string. It is copied into the arena once and
+// split in place, so argv points straight into that copy and there are no
+// limits on the number or length of args. Any `|` stages after the command
+// and every stage's redirections go to the pipeline global. Redirections are
+// only parsed here, open_redirs() opens them.
+int parse(Arena *arena, const CmdDef **cmd_def, CmdArgv *argv, int *argc, const char *cmd)
+{
+	size_t len = strcspn(cmd, "\n");
+	char *line = (char *) arena_alloc(arena, len + 1);
+	int arg_cap = 16;
+	char **args = (char **) arena_alloc(arena, sizeof(char *) * arg_cap);
+	// args[0] is left free in case this turns out to be a bare program name
+	// that needs "start" in front of it. Stages are separated by NULLs, the
+	// first arg of each stage is at stage_starts[i].
+	int arg = 1;
+	int stage_cap = 4;
+	int *stage_starts = (int *) arena_alloc(arena, sizeof(int) * stage_cap);
+	Redir **stage_redirs = (Redir **) arena_alloc(arena, sizeof(Redir *) * stage_cap);
+	Redir **redir_tail = stage_redirs;
+	Redir *redir = NULL; // Waiting for its target
+	int redir_fd = -1; // From a `2>` style prefix
+	int *grown;
+	Redir **grown_redirs;
+	int num_stages = 1;
+	char *p = line, *tok;
+	char c;
+	pipeline.num_stages = 0;
+	pipeline.redirs = stage_redirs;
+	stage_starts[0] = 1;
+	stage_redirs[0] = NULL;
+
+	memcpy(line, cmd, len);
+	line[len] = '\0';
+
+	while (1) {
+		while (IS_WHITESPACE(*p))
+			p++;
+		c = *p;
+
+		if (c != '\0' && c != '<' && c != '>' && c != '|') {
+			tok = p;
+			for (; *p != '\0' && *p != '<' && *p != '>' && *p != '|' && !IS_WHITESPACE(*p); p++) {
+				if (!IS_ALLOWED(*p))
+					return PARSE_INVALID_CHAR;
+				if (*p == REPL_ENV_CHAR)
+					*p = '$';
+				else if (*p == REPL_WS_CHAR)
+					*p = ' ';
+			}
+
+			c = *p;
+			*p = '\0';
+
+			if (redir) {
+				redir->target = tok;
+				if (redir->kind == REDIR_DUP) {
+					if (strcmp(tok, "-") == 0)
+						redir->dup_fd = REDIR_CLOSED;
+					else if (is_number(tok) && strlen(tok) < 3)
+						redir->dup_fd = atoi(tok);
+					else
+						return PARSE_INVALID_REDIR;
+				}
+				redir = NULL;
+			}
+			else if ((c == '<' || c == '>') && is_number(tok)) {
+				// Digits right before an operator name the descriptor
+				redir_fd = strlen(tok) < 3 ? atoi(tok) : REDIR_MAX_FD;
+			}
+			else {
+				push_arg(arena, &args, &arg, &arg_cap, tok);
+			}
+
+			if (IS_WHITESPACE(c)) {
+				p++;
+				continue;
+			}
+		}
+
+		if (c == '\0')
+			break;
+
+		if (c == '|') {
+			// Stages can't be empty
+			if (redir || redir_fd >= 0 || arg == stage_starts[num_stages - 1])
+				return PARSE_INVALID_PIPE;
+
+			push_arg(arena, &args, &arg, &arg_cap, NULL);
+			if (num_stages == stage_cap) {
+				grown = (int *) arena_alloc(arena, sizeof(int) * stage_cap * 2);
+				memcpy(grown, stage_starts, sizeof(int) * num_stages);
+				stage_starts = grown;
+				grown_redirs = (Redir **) arena_alloc(arena, sizeof(Redir *) * stage_cap * 2);
+				memcpy(grown_redirs, stage_redirs, sizeof(Redir *) * num_stages);
+				stage_redirs = grown_redirs;
+				pipeline.redirs = stage_redirs;
+				stage_cap *= 2;
+			}
+			stage_starts[num_stages] = arg;
+			stage_redirs[num_stages] = NULL;
+			redir_tail = stage_redirs + num_stages;
+			num_stages++;
+			p++;
+			continue;
+		}
+
+		// c is '<' or '>'
+		if (redir)
+			return PARSE_INVALID_REDIR;
+
+		redir = (Redir *) arena_alloc(arena, sizeof(Redir));
+		memset(redir, 0, sizeof(Redir));
+		redir->open_fd = -1;
+		redir->fd = redir_fd >= 0 ? redir_fd : (c == '<' ? STDIN_FILENO : STDOUT_FILENO);
+		redir_fd = -1;
+		if (redir->fd >= REDIR_MAX_FD)
+			return PARSE_INVALID_REDIR;
+
+		if (c == '<' && p[1] == '<' && p[2] == '<') {
+			redir->kind = REDIR_HERESTR;
+			p += 3;
+		}
+		else if (c == '<' && p[1] == '<') {
+			redir->kind = REDIR_HEREDOC;
+			p += 2;
+		}
+		else if (p[1] == '&') {
+			redir->kind = REDIR_DUP;
+			p += 2;
+		}
+		else if (c == '<') {
+			redir->kind = REDIR_IN;
+			p++;
+		}
+		else if (p[1] == '>') {
+			redir->kind = REDIR_APPEND;
+			p += 2;
+		}
+		else {
+			redir->kind = REDIR_OUT;
+			p++;
+		}
+
+		*redir_tail = redir;
+		redir_tail = &redir->next;
+	}
+
+	if (redir || redir_fd >= 0)
+		return PARSE_INVALID_REDIR;
+
+	args[arg] = NULL;
+	*argv = args + 1;
+	*argc = (num_stages > 1 ? stage_starts[1] - 1 : arg) - 1;
+
+	if (num_stages > 1) {
+		if (arg == stage_starts[num_stages - 1])
+			return PARSE_INVALID_PIPE;
+
+		pipeline.stages = (char ***) arena_alloc(arena, sizeof(char **) * (num_stages - 1));
+		for (int i = 1; i < num_stages; i++)
+			pipeline.stages[i - 1] = args + stage_starts[i];
+		pipeline.num_stages = num_stages - 1;
+	}
+
+	if (*argc == 0)
+		return PARSE_INVALID_CMD;
+
+	if ((*cmd_def = parse_cmd(args[1])) == NULL) {
+		// Not a builtin, run it as if it were `start <cmd>`
+		if (path_lookup(args[1]) == NULL)
+			return PARSE_INVALID_CMD;
+		args[0] = "start";
+		*argv = args;
+		(*argc)++;
+		*cmd_def = parse_cmd(args[0]);
+	}
+
+	return PARSE_OK;
+}
+
+// Reads the bodies of any here-docs in the pipeline global from the input
+// lines that follow the command, up to their delimiter lines
+void read_heredocs(Shell *shelly)
+{
+	Redir *redir;
+	int c;
+
+	for (int i = 0; i <= pipeline.num_stages; i++) {
+		for (redir = pipeline.redirs[i]; redir; redir = redir->next) {
+			if (redir->kind != REDIR_HEREDOC)
+				continue;
+
+			while (1) {
+				size_t line_start = redir->body.len;
+
+				if (shell_is_interactive && shelly->input == &shelly->main_input)
+					printf("> ");
+				while ((c = shell_getc(shelly)) != '\n' && c != EOF) {
+					char ch = c;
+					sb_append(&redir->body, &ch, 1);
+				}
+
+				if (strlen(redir->target) == redir->body.len - line_start
+					&& memcmp(redir->body.data + line_start, redir->target,
+						redir->body.len - line_start) == 0) {
+					redir->body.len = line_start;
+					break;
+				}
+				if (c == EOF)
+					break;
+				sb_append(&redir->body, "\n", 1);
+			}
+		}
+	}
+}
+
+// Data for here-strings and here-docs lives in a memfd, so the child reads it
+// like a file without a temp file or an echo process
+static int open_memfd(const char *data, size_t len)
+{
+	int fd = memfd_create("shelly-here", MFD_CLOEXEC);
+	size_t off = 0;
+	ssize_t n;
+
+	if (fd < 0)
+		return -1;
+
+	while (off < len) {
+		n = write(fd, data + off, len - off);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			close(fd);
+			return -1;
+		}
+		off += n;
+	}
+	lseek(fd, 0, SEEK_SET);
+	return fd;
+}
+
+// Opens the files and here-data of every redirection in the pipeline global
+int open_redirs(void)
+{
+	Redir *redir;
+	int mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+
+	for (int i = 0; i <= pipeline.num_stages; i++) {
+		for (redir = pipeline.redirs[i]; redir; redir = redir->next) {
+			switch (redir->kind) {
+				case REDIR_IN:
+					redir->open_fd = open(redir->target, O_RDONLY | O_CLOEXEC);
+					break;
+				case REDIR_OUT:
+					redir->open_fd = open(redir->target,
+						O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+					break;
+				case REDIR_APPEND:
+					redir->open_fd = open(redir->target,
+						O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, mode);
+					break;
+				case REDIR_HERESTR:
+					sb_append(&redir->body, redir->target, strlen(redir->target));
+					sb_append(&redir->body, "\n", 1);
+					redir->open_fd = open_memfd(redir->body.data, redir->body.len);
+					break;
+				case REDIR_HEREDOC:
+					redir->open_fd = open_memfd(redir->body.data, redir->body.len);
+					break;
+				case REDIR_DUP:
+					continue;
+			}
+
+			if (redir->open_fd < 0) {
+				printf("%s: %s\n", redir->target, strerror(errno));
+				return PARSE_INVALID_FILE;
+			}
+		}
+	}
+
+	return PARSE_OK;
+}
+
+void close_redirs(void)
+{
+	Redir *redir;
+
+	if (pipeline.redirs == NULL)
+		return;
+
+	for (int i = 0; i <= pipeline.num_stages; i++) {
+		for (redir = pipeline.redirs[i]; redir; redir = redir->next) {
+			if (redir->open_fd >= 0)
+				close(redir->open_fd);
+			redir->open_fd = -1;
+			sb_free(&redir->body);
+		}
+	}
+	pipeline.num_stages = 0;
+	pipeline.redirs = NULL;
+}
+
+
+
+// Runs every line of filepath. Returns -1 with errno set if it can't be read.
+int source_file(Shell *shelly, char *filepath)
+{
+	InputSrc src, *prev = shelly->input;
+
+	if (shelly->source_depth >= SOURCE_MAX_DEPTH) {
+		errno = ELOOP;
+		return -1;
+	}
+
+	src.fd = open(filepath, O_RDONLY | O_CLOEXEC);
+	if (src.fd < 0)
+		return -1;
+	src.polled = 0;
+	src.buf = (char *) malloc(INPUT_BUF_SIZE);
+	src.pos = src.len = 0;
+
+	shelly->input = &src;
+	shelly->source_depth++;
+	run_input(shelly);
+	shelly->source_depth--;
+	shelly->input = prev;
+
+	free(src.buf);
+	close(src.fd);
+	return 0;
+}
+
+int source_cmd(Shell *shell, CmdArgv argv, int argc)
+{
+	if (argc != 2)
+		return 1;
+
+	if (source_file(shell, argv[1]) < 0) {
+		printf("source: %s: %s\n", argv[1], strerror(errno));
+		shell->last_status = 1;
+	}
+	return 0;
+}
+
+int source_cmd_help(Shell *shell, CmdArgv argv, int argc)
+{
+	printf("source <file>                run the commands in <file>\n");
+	return 0;
+}
+
+
+
+// Converts a wait status into a shell style exit code
+int exit_code(int status)
+{
+	if (WIFEXITED(status))
+		return WEXITSTATUS(status);
+	if (WIFSIGNALED(status))
+		return 128 + WTERMSIG(status);
+	return 0;
+}
+
+static void print_exec_error(int err)
+{
+	switch (err) {
+		case EACCES:
+			printf("Access denied.\n");
+			break;
+		case EIO:
+			printf("An I/O error has occured.\n");
+			break;
+		case ENOENT:
+			printf("Does not exist.\n");
+			break;
+		default:
+			printf("An error has occured (%d)\n", err);
+			break;
+	}
+}
+
+// Signals the shell ignores or handles that children should get back
+static void job_control_sigset(sigset_t *set)
+{
+	sigemptyset(set);
+	sigaddset(set, SIGINT);
+	sigaddset(set, SIGQUIT);
+	sigaddset(set, SIGTSTP);
+	sigaddset(set, SIGTTIN);
+	sigaddset(set, SIGTTOU);
+	sigaddset(set, SIGCHLD);
+}
+
+// fork() backend. Its cost grows with the size of the shell's address space.
+static pid_t fork_process(const char *path, char **argv, int pgid, const int *fds)
+{
+	sigset_t sigdef;
+
+  // Forking a child
+  pid_t pid = fork(); 
+
+  if (pid == -1) {
+    printf("\nFailed forking child..");
+    return -1;
+  } else if (pid == 0) {
+    pid = getpid ();
+    if (pgid == 0) pgid = pid;
+      setpgid (pid, pgid);
+
+		job_control_sigset(&sigdef);
+		for (int sig = 1; sig < NSIG; sig++) {
+			if (sigismember(&sigdef, sig) == 1)
+				signal(sig, SIG_DFL);
+		}
+		sigemptyset(&sigdef);
+		sigprocmask(SIG_SETMASK, &sigdef, NULL);
+
+		// Our descriptors are close-on-exec, dup2 clears it on the copies
+		for (int fd = 0; fd < REDIR_MAX_FD; fd++) {
+			if (fds[fd] == REDIR_CLOSED)
+				close(fd);
+			else if (fds[fd] >= 0 && fds[fd] != fd)
+				dup2(fds[fd], fd);
+			else if (fds[fd] == fd)
+				fcntl(fd, F_SETFD, 0);
+		}
+
+    execve(path, argv, var_envp());
+		print_exec_error(errno);
+		fflush(stdout);
+    _exit(127);
+  }
+
+	return pid;
+}
+
+// posix_spawn() backend. glibc implements it with clone(CLONE_VM|CLONE_VFORK),
+// so nothing gets copied no matter how big the shell is, and exec errors are
+// reported straight back to us.
+static pid_t spawn_process(const char *path, char **argv, int pgid, const int *fds)
+{
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	sigset_t sigdef, sigmask;
+	pid_t pid;
+	int err;
+
+	posix_spawn_file_actions_init(&actions);
+	for (int fd = 0; fd < REDIR_MAX_FD; fd++) {
+		if (fds[fd] == REDIR_CLOSED)
+			posix_spawn_file_actions_addclose(&actions, fd);
+		else if (fds[fd] >= 0)
+			// Also clears close-on-exec when fds[fd] == fd
+			posix_spawn_file_actions_adddup2(&actions, fds[fd], fd);
+	}
+
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setpgroup(&attr, pgid);
+	job_control_sigset(&sigdef);
+	posix_spawnattr_setsigdefault(&attr, &sigdef);
+	// SIGCHLD may be blocked while `repeat -j` waits
+	sigemptyset(&sigmask);
+	posix_spawnattr_setsigmask(&attr, &sigmask);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF
+		| POSIX_SPAWN_SETSIGMASK);
+
+	err = posix_spawn(&pid, path, &actions, &attr, argv, var_envp());
+
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+
+	if (err != 0) {
+		print_exec_error(err);
+		return -1;
+	}
+	return pid;
+}
+
+// fds[n] is the descriptor of ours the child gets as n, -1 to leave n as
+// it is and REDIR_CLOSED to close it
+int launch_process(char **argv, int pgid, const int *fds, int foreground)
+{
+	const char *backend = var_get(ENV_SPAWN);
+	int child_fds[REDIR_MAX_FD];
+	int moved[REDIR_MAX_FD];
+	int num_moved = 0;
+	pid_t pid;
+
+	// Resolved in the parent so the lookup is cached for next time
+	const char *path = path_lookup(argv[0]);
+	if (path == NULL) {
+		printf("Does not exist.\n");
+		return foreground ? 127 : -1;
+	}
+
+	// A low source descriptor could be overwritten by an earlier dup2 in the
+	// child (think 1>&2 2>&1), so move those out of the way first
+	for (int fd = 0; fd < REDIR_MAX_FD; fd++) {
+		child_fds[fd] = fds[fd];
+		if (fds[fd] >= 0 && fds[fd] < REDIR_MAX_FD && fds[fd] != fd) {
+			child_fds[fd] = fcntl(fds[fd], F_DUPFD_CLOEXEC, REDIR_MAX_FD);
+			moved[num_moved++] = child_fds[fd];
+		}
+	}
+
+	// Don't let the child inherit (and repeat) our buffered output
+	fflush(stdout);
+	if (backend && strcmp(backend, "fork") == 0)
+		pid = fork_process(path, argv, pgid, child_fds);
+	else
+		pid = spawn_process(path, argv, pgid, child_fds);
+
+	for (int i = 0; i < num_moved; i++)
+		close(moved[i]);
+
+	if (pid < 0)
+		return foreground ? 127 : -1;
+
+	// waiting for child to terminate
+	// Returns the exit code for foreground processes
+	if (foreground) {
+		int status;
+		if (waitpid(pid, &status, 0) < 0)
+			return 0;
+		return exit_code(status);
+	}
+
+	return pid;
+}
+
+// Starts argv and every stage in the pipeline global, each reading the
+// previous one's output. The first stage reads infile, the last writes to
+// outfile and all of them write errors to errfile, then each stage's
+// redirections are applied on top. Every stage joins process group pgid (0
+// for a new group led by the first stage). The pids go into *pids, an array
+// from the command arena when that's NULL. Returns how many stages were
+// started, fewer than asked for if one failed.
+int launch_pipeline(Shell *shell, char **argv, int pgid,
+	int infile, int outfile, int errfile, pid_t **pids)
+{
+	int num = pipeline.num_stages + 1;
+	const char *pipe_size = var_get(ENV_PIPE_SIZE);
+	int fds[2];
+	int stage_in = infile, stage_out;
+	char **stage_argv = argv;
+	int fdtab[REDIR_MAX_FD];
+	Redir *redir;
+	int i;
+
+	if (*pids == NULL)
+		*pids = (pid_t *) arena_alloc(&shell->cmd_arena, sizeof(pid_t) * num);
+
+	for (i = 0; i < num; i++) {
+		if (i > 0)
+			stage_argv = pipeline.stages[i - 1];
+
+		if (i < num - 1) {
+			if (pipe2(fds, O_CLOEXEC) < 0) {
+				printf("Unable to create pipe!\n");
+				break;
+			}
+			if (pipe_size)
+				fcntl(fds[1], F_SETPIPE_SZ, (int) strtol(pipe_size, NULL, 10));
+			stage_out = fds[1];
+		}
+		else {
+			stage_out = outfile;
+		}
+
+		fdtab[STDIN_FILENO] = stage_in;
+		fdtab[STDOUT_FILENO] = stage_out;
+		fdtab[STDERR_FILENO] = errfile;
+		for (int fd = STDERR_FILENO + 1; fd < REDIR_MAX_FD; fd++)
+			fdtab[fd] = -1;
+
+		// In order, so `>file 2>&1` and `2>&1 >file` differ like in sh
+		for (redir = pipeline.redirs[i]; redir; redir = redir->next) {
+			if (redir->kind != REDIR_DUP)
+				fdtab[redir->fd] = redir->open_fd;
+			else if (redir->dup_fd == REDIR_CLOSED || redir->dup_fd >= REDIR_MAX_FD)
+				fdtab[redir->fd] = REDIR_CLOSED;
+			else
+				fdtab[redir->fd] = fdtab[redir->dup_fd] == -1
+					? REDIR_CLOSED : fdtab[redir->dup_fd];
+		}
+
+		(*pids)[i] = launch_process(stage_argv, pgid, fdtab, 0);
+
+		// The children have their own copies now
+		if (stage_in != infile)
+			close(stage_in);
+		if (stage_out != outfile)
+			close(stage_out);
+
+		if ((*pids)[i] < 0) {
+			if (i < num - 1)
+				close(fds[0]);
+			break;
+		}
+
+		if (pgid == 0)
+			pgid = (*pids)[i];
+		if (i < num - 1)
+			stage_in = fds[0];
+	}
+
+	return i;
+}
+
+void usage_add(JobUsage *usage, const struct rusage *ru)
+{
+	usage->user_us += ru->ru_utime.tv_sec * 1000000LL + ru->ru_utime.tv_usec;
+	usage->sys_us += ru->ru_stime.tv_sec * 1000000LL + ru->ru_stime.tv_usec;
+	if (ru->ru_maxrss > usage->max_rss_kb)
+		usage->max_rss_kb = ru->ru_maxrss;
+	usage->ctx_switches += ru->ru_nvcsw + ru->ru_nivcsw;
+}
+
+// Waits for the num_pids processes started for a num_stages long pipeline,
+// adding what they used to usage unless it's NULL. Returns the exit code of
+// the last stage.
+int wait_pipeline(pid_t *pids, int num_pids, int num_stages, JobUsage *usage)
+{
+	struct rusage ru;
+	int status, code = 127;
+
+	for (int i = 0; i < num_pids; i++) {
+		if (wait4(pids[i], &status, 0, &ru) < 0)
+			status = 0;
+		else if (usage)
+			usage_add(usage, &ru);
+		if (i == num_stages - 1)
+			code = exit_code(status);
+	}
+
+	return code;
+}
+
+// Length of the variable name at the start of p (at most len bytes), 0 if
+// there isn't one. Names are [A-Za-z_][A-Za-z0-9_]*.
+size_t var_name_len(const char *p, size_t len)
+{
+	size_t n = 0;
+
+	if (len == 0 || !(isalpha((unsigned char) p[0]) || p[0] == '_'))
+		return 0;
+	while (n < len && (isalnum((unsigned char) p[n]) || p[n] == '_'))
+		n++;
+	return n;
+}
+
+// Appends str (len bytes) to out with $VAR, ${VAR}, ${VAR:-default} and
+// ${VAR-default} expanded in a single pass. Defaults are expanded too. \$ is
+// a literal $, unset variables expand to nothing and anything that isn't a
+// valid expansion (a lone $, an unterminated ${) is copied as is.
+void expand_vars(StrBuf *out, const char *str, size_t len)
+{
+	const char *p = str, *end = str + len;
+	const char *run = str; // Start of text not yet copied
+	const char *name, *op, *close, *val;
+	size_t n;
+	int depth;
+
+	while (p < end) {
+		if (*p == '\\' && p + 1 < end && p[1] == '$') {
+			sb_append(out, run, p - run);
+			// The $ starts the next run, past it so it isn't expanded
+			run = ++p;
+			p++;
+			continue;
+		}
+		if (*p != '$') {
+			p++;
+			continue;
+		}
+
+		if (p + 1 < end && p[1] == '{') {
+			name = p + 2;
+			for (close = name, depth = 1; close < end; close++) {
+				if (close[0] == '$' && close + 1 < end && close[1] == '{') {
+					depth++;
+					close++;
+				}
+				else if (close[0] == '}' && --depth == 0) {
+					break;
+				}
+			}
+			n = var_name_len(name, close - name);
+			op = name + n;
+			if (close == end || n == 0
+				|| !(op == close || op[0] == '-' || (op[0] == ':' && op[1] == '-'))) {
+				p++;
+				continue;
+			}
+
+			sb_append(out, run, p - run);
+			val = var_lookup(name, n);
+			if (op[0] == ':' && (val == NULL || *val == '\0'))
+				expand_vars(out, op + 2, close - op - 2);
+			else if (op[0] == '-' && val == NULL)
+				expand_vars(out, op + 1, close - op - 1);
+			else if (val)
+				sb_append(out, val, strlen(val));
+			p = run = close + 1;
+		}
+		else if ((n = var_name_len(p + 1, end - p - 1)) > 0) {
+			sb_append(out, run, p - run);
+			if ((val = var_lookup(p + 1, n)) != NULL)
+				sb_append(out, val, strlen(val));
+			p = run = p + 1 + n;
+		}
+		else {
+			p++;
+		}
+	}
+
+	sb_append(out, run, end - run);
+}
+
+static void prompt_push(Prompt *prompt, enum PromptSegKind kind,
+	const char *text, size_t len)
+{
+	PromptSeg *seg;
+
+	// Runs of text are kept in one segment
+	if (kind == SEG_TEXT && prompt->num_segs > 0
+		&& (seg = prompt->segs + prompt->num_segs - 1)->kind == SEG_TEXT) {
+		seg->text = (char *) realloc(seg->text, strlen(seg->text) + len + 1);
+		strncat(seg->text, text, len);
+		return;
+	}
+
+	prompt->segs = (PromptSeg *) realloc(prompt->segs,
+		sizeof(PromptSeg) * (prompt->num_segs + 1));
+	seg = prompt->segs + prompt->num_segs++;
+	seg->kind = kind;
+	seg->text = strndup(text, len);
+	seg->value = NULL;
+	if (kind == SEG_VAR && var_get(seg->text))
+		seg->value = strdup(var_get(seg->text));
+	else if (kind == SEG_CMD)
+		prompt->num_cmds++;
+}
+
+static void prompt_free_segs(Prompt *prompt)
+{
+	for (int i = 0; i < prompt->num_segs; i++) {
+		free(prompt->segs[i].text);
+		free(prompt->segs[i].value);
+	}
+	free(prompt->segs);
+	prompt->segs = NULL;
+	prompt->num_segs = prompt->num_cmds = 0;
+}
+
+// Splits tmpl into text, $VAR and $(cmd) segments and looks the variables up
+static void prompt_compile(Prompt *prompt, const char *tmpl)
+{
+	const char *p = tmpl, *start;
+	size_t len;
+	int depth;
+
+	prompt_free_segs(prompt);
+	// Always at least one segment, so segs != NULL means compiled
+	prompt_push(prompt, SEG_TEXT, "", 0);
+	prompt->gen++;
+	prompt->dirty = 0;
+
+	while (*p != '\0') {
+		if (p[0] == '$' && p[1] == '(') {
+			start = p + 2;
+			for (p = start, depth = 1; *p != '\0'; p++) {
+				if (*p == '(')
+					depth++;
+				else if (*p == ')' && --depth == 0)
+					break;
+			}
+			prompt_push(prompt, SEG_CMD, start, p - start);
+			if (*p == ')')
+				p++;
+		}
+		else if (p[0] == '$' && (len = var_name_len(p + 1, strlen(p + 1))) > 0) {
+			prompt_push(prompt, SEG_VAR, p + 1, len);
+			p += 1 + len;
+		}
+		else {
+			prompt_push(prompt, SEG_TEXT, p, 1);
+			p++;
+		}
+	}
+}
+
+// Called when variable name is set. A new template is compiled at the next
+// prompt; a variable the prompt uses just has its value updated.
+void prompt_changed(Shell *shelly, const char *name)
+{
+	Prompt *prompt = &shelly->prompt;
+	PromptSeg *seg;
+	const char *val;
+
+	if (strcmp(name, ENV_PROMPT) == 0) {
+		prompt->dirty = 1;
+		return;
+	}
+	for (int i = 0; i < prompt->num_segs; i++) {
+		seg = prompt->segs + i;
+		if (seg->kind == SEG_VAR && strcmp(seg->text, name) == 0) {
+			val = var_get(name);
+			free(seg->value);
+			seg->value = val ? strdup(val) : NULL;
+		}
+	}
+}
+
+// Reads every command's output, runs on its own thread
+static int prompt_job_run(void *arg)
+{
+	PromptJob *job = (PromptJob *) arg;
+	siginfo_t info;
+	StrBuf buf;
+	char chunk[512];
+	ssize_t n;
+
+	for (int i = 0; i < job->num; i++) {
+		memset(&buf, 0, sizeof(buf));
+		if (job->fds[i] >= 0) {
+			while ((n = read(job->fds[i], chunk, sizeof(chunk))) != 0) {
+				if (n < 0 && errno == EINTR)
+					continue;
+				if (n < 0)
+					break;
+				sb_append(&buf, chunk, n);
+			}
+			close(job->fds[i]);
+		}
+		// Through the pidfd, a pid could already be someone else's if the
+		// shell reaped this one while looking for its own children. Then
+		// this fails with ECHILD, which is fine.
+		if (job->pidfds[i] >= 0) {
+			while (waitid((idtype_t) P_PIDFD, job->pidfds[i], &info, WEXITED) < 0
+				&& errno == EINTR)
+				;
+			close(job->pidfds[i]);
+		}
+
+		while (buf.len > 0 && buf.data[buf.len - 1] == '\n')
+			buf.len--;
+		job->out[i] = strndup(buf.data ? buf.data : "", buf.len);
+		sb_free(&buf);
+	}
+
+	atomic_store(&job->done, 1);
+	return 0;
+}
+
+static void prompt_job_free(PromptJob *job)
+{
+	for (int i = 0; i < job->num; i++)
+		free(job->out[i]);
+	free(job->out);
+	free(job->fds);
+	free(job->pidfds);
+	free(job);
+}
+
+// Picks up the output of the last round of $(cmd) segments if it's ready,
+// and starts another round if none is running. Never waits on them.
+static void prompt_refresh(Prompt *prompt)
+{
+	PromptJob *job = prompt->job;
+	char *argv[4] = {PROMPT_CMD_SHELL, "-c", NULL, NULL};
+	int fdtab[REDIR_MAX_FD];
+	int fds[2], devnull, i, c;
+	pid_t pid;
+	thrd_t thread;
+
+	if (job) {
+		if (!atomic_load(&job->done))
+			return;
+		if (job->gen == prompt->gen) {
+			for (i = 0, c = 0; i < prompt->num_segs; i++) {
+				if (prompt->segs[i].kind != SEG_CMD)
+					continue;
+				free(prompt->segs[i].value);
+				prompt->segs[i].value = job->out[c];
+				job->out[c++] = NULL;
+			}
+		}
+		prompt_job_free(job);
+		prompt->job = NULL;
+	}
+
+	job = (PromptJob *) calloc(1, sizeof(PromptJob));
+	job->num = prompt->num_cmds;
+	job->gen = prompt->gen;
+	job->pidfds = (int *) calloc(job->num, sizeof(int));
+	job->fds = (int *) calloc(job->num, sizeof(int));
+	job->out = (char **) calloc(job->num, sizeof(char *));
+	atomic_init(&job->done, 0);
+
+	// Output only, and in their own process group so ^C doesn't reach them
+	devnull = open("/dev/null", O_RDWR | O_CLOEXEC);
+	for (int fd = 0; fd < REDIR_MAX_FD; fd++)
+		fdtab[fd] = -1;
+	fdtab[STDIN_FILENO] = devnull;
+	fdtab[STDERR_FILENO] = devnull;
+	for (i = 0, c = 0; i < prompt->num_segs; i++) {
+		if (prompt->segs[i].kind != SEG_CMD)
+			continue;
+		job->fds[c] = -1;
+		job->pidfds[c] = -1;
+		if (pipe2(fds, O_CLOEXEC) == 0) {
+			argv[2] = prompt->segs[i].text;
+			fdtab[STDOUT_FILENO] = fds[1];
+			// Opened before we get back to the event loop, so the pid can't
+			// have been reaped and reused yet. Without pidfds the exit is
+			// left to handle_sigchld(), which reaps children it doesn't know.
+			if ((pid = launch_process(argv, 0, fdtab, 0)) > 0)
+				job->pidfds[c] = syscall(SYS_pidfd_open, pid, 0);
+			close(fds[1]);
+			job->fds[c] = fds[0];
+		}
+		c++;
+	}
+	if (devnull >= 0)
+		close(devnull);
+
+	if (thrd_create(&thread, prompt_job_run, job) != thrd_success) {
+		// Out of threads, read them here this once
+		prompt_job_run(job);
+		prompt_job_free(job);
+		return;
+	}
+	thrd_detach(thread);
+	prompt->job = job;
+}
+
+// Returns the prompt text, valid until the next call
+const char* prompt_render(Shell *shelly)
+{
+	Prompt *prompt = &shelly->prompt;
+	const char *tmpl;
+	const char *val;
+
+	if (prompt->segs == NULL || prompt->dirty) {
+		tmpl = var_get(ENV_PROMPT);
+		prompt_compile(prompt, tmpl ? tmpl : DEFAULT_PROMPT);
+	}
+	if (prompt->num_cmds > 0)
+		prompt_refresh(prompt);
+
+	prompt->out.len = 0;
+	for (int i = 0; i < prompt->num_segs; i++) {
+		val = prompt->segs[i].kind == SEG_TEXT ? prompt->segs[i].text : prompt->segs[i].value;
+		if (val)
+			sb_append(&prompt->out, val, strlen(val));
+	}
+	sb_append(&prompt->out, "", 1);
+	return prompt->out.data;
+}
+
+void prompt_free(Prompt *prompt)
+{
+	prompt_free_segs(prompt);
+	sb_free(&prompt->out);
+	// A running job's thread still owns it, and we're on our way out anyway
+	if (prompt->job && atomic_load(&prompt->job->done))
+		prompt_job_free(prompt->job);
+	prompt->job = NULL;
+}
+
+const char* get_random_greeting() {
+	int len = 0;	
+
+	while (greetings[len] != NULL)
+		len++;
+	
+	return greetings[rand() % len];	
+}
+
+void init_shell(Shell *shelly, int is_interactive) {
+	StrBuf hist_filepath = {0};
+	const char *hist_format, *hist_batch, *hist_fsync;
+
+	builtin_slots_check();
+	vars_init();
+	hist_format = var_get(ENV_HIST_FORMAT);
+	hist_batch = var_get(ENV_HIST_BATCH);
+	hist_fsync = var_get(ENV_HIST_FSYNC);
+
+	expand_vars(&hist_filepath, HIST_FILEPATH, strlen(HIST_FILEPATH));
+	sb_append(&hist_filepath, "", 1);
+  shelly->hist_filepath = hist_filepath.data;
+  memset(&shelly->hist, 0, sizeof(shelly->hist));
+	shelly->hist.binary = !(hist_format && strcmp(hist_format, "text") == 0);
+	shelly->hist.fd = -1;
+	shelly->hist.batch = hist_batch ? strtol(hist_batch, NULL, 10) : HIST_BATCH_DEFAULT;
+	if (shelly->hist.batch < 1)
+		shelly->hist.batch = 1;
+	shelly->hist.fsync = hist_fsync && strcmp(hist_fsync, "1") == 0;
+	// printf("%s\n", hist_filepath);
+
+	shelly->cwd = getcwd(NULL, 0);
+	shelly->cwd_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+	shelly->dir_stack = NULL;
+	shelly->dir_stack_len = shelly->dir_stack_cap = 0;
+	memset(&shelly->dirs, 0, sizeof(shelly->dirs));
+	memset(&shelly->cmd_arena, 0, sizeof(shelly->cmd_arena));
+	shelly->is_running = 1;
+	memset(&shelly->jobs, 0, sizeof(shelly->jobs));
+	memset(&shelly->fg_usage, 0, sizeof(shelly->fg_usage));
+	shelly->fg_wall_ns = 0;
+	memset(&shelly->prompt, 0, sizeof(shelly->prompt));
+	memset(&shelly->compl, 0, sizeof(shelly->compl));
+	memset(&shelly->hist_index, 0, sizeof(shelly->hist_index));
+	memset(&shelly->line, 0, sizeof(shelly->line));
+	memset(&shelly->expanded, 0, sizeof(shelly->expanded));
+	shelly->jobs.free_head = -1;
+	if (mtx_init(&(shelly->bg_mtx), mtx_plain) != thrd_success) {
+		printf("Unable to create mutex for bg job list!\n");
+		exit(1);
+	}
+
+	// if (is_interactive) {
+	// 	root_shell = shelly;
+	// 	signal(SIGTERM, termination_handler);
+	// 	signal(SIGINT, SIG_IGN);
+	// }
+
+	// No SA_RESTART so a blocking read returns and the main loop can exit
+	root_shell = shelly;
+	struct sigaction term_action;
+	memset(&term_action, 0, sizeof(term_action));
+	term_action.sa_handler = termination_handler;
+	sigemptyset(&term_action.sa_mask);
+	sigaction(SIGTERM, &term_action, NULL);
+	sigaction(SIGHUP, &term_action, NULL);
+
+  /* See if we are running interactively.  */
+  shell_terminal = STDIN_FILENO;
+  shell_is_interactive = is_interactive && isatty (shell_terminal);
+	// Otherwise stay in the group we were started in, with our children
+	shell_pgid = getpgrp();
+	shelly->exit_status = 0;
+
+  if (shell_is_interactive) {
+		root_shell = shelly;
+    /* Loop until we are in the foreground.  */
+    while (tcgetpgrp (shell_terminal) != (shell_pgid = getpgrp ()))
+      kill (- shell_pgid, SIGTTIN);
+
+    /* Ignore interactive and job-control signals.  */
+    signal(SIGINT, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+
+    /* Put ourselves in our own process group.  */
+    /* A session leader (say, under script or a terminal emulator) already
+       leads its group and can't call setpgid.  */
+    shell_pgid = getpid ();
+    if (getpgrp () != shell_pgid && setpgid (shell_pgid, shell_pgid) < 0)
+      {
+        perror ("Couldn't put the shell in its own process group");
+        exit (1);
+      }
+
+    /* Grab control of the terminal.  */
+    tcsetpgrp (shell_terminal, shell_pgid);
+
+    /* Save default terminal attributes for shell.  */
+    tcgetattr (shell_terminal, &shell_tmodes);
+  }
+
+	events_init(shelly);
+
+  shelly->infile = STDIN_FILENO;
+  shelly->outfile = STDOUT_FILENO;
+  shelly->errfile = STDERR_FILENO;
+}
+
+void sb_reserve(StrBuf *sb, size_t extra)
+{
+	size_t cap = sb->cap ? sb->cap : 256;
+
+	if (sb->len + extra <= sb->cap)
+		return;
+
+	while (cap < sb->len + extra)
+		cap *= 2;
+
+	sb->data = (char *) realloc(sb->data, cap);
+	if (sb->data == NULL) {
+		printf("Out of memory!\n");
+		exit(1);
+	}
+	sb->cap = cap;
+}
+
+void sb_append(StrBuf *sb, const char *str, size_t len)
+{
+	if (len == 0)
+		return;
+	sb_reserve(sb, len);
+	memcpy(sb->data + sb->len, str, len);
+	sb->len += len;
+}
+
+void sb_free(StrBuf *sb)
+{
+	free(sb->data);
+	sb->data = NULL;
+	sb->len = sb->cap = 0;
+}
+
+int64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Appends cmd (len bytes, not necessarily null terminated) as the newest
+// entry. meta may be NULL when nothing is known about the entry.
+void hist_push(CmdHist *hist, const char *cmd, size_t len, const HistMeta *meta)
+{
+	HistEntry *ent;
+	const char *cwd = (meta && meta->cwd) ? meta->cwd : "";
+	size_t cwd_len = strlen(cwd);
+
+	if (hist->nents == hist->cap) {
+		hist->cap = hist->cap ? hist->cap * 2 : 64;
+		hist->ents = (HistEntry *) realloc(hist->ents, sizeof(HistEntry) * hist->cap);
+		if (hist->ents == NULL) {
+			printf("Out of memory!\n");
+			exit(1);
+		}
+	}
+
+	ent = hist->ents + hist->nents;
+	sb_reserve(&hist->arena, len + cwd_len + 2);
+	ent->off = hist->arena.len;
+	ent->len = len;
+	sb_append(&hist->arena, cmd, len);
+	hist->arena.data[hist->arena.len++] = '\0';
+	ent->cwd_off = hist->arena.len;
+	sb_append(&hist->arena, cwd, cwd_len + 1);
+	ent->when = meta ? meta->when : 0;
+	ent->dur_us = meta ? meta->dur_us : 0;
+	ent->status = meta ? meta->status : 0;
+	hist->nents++;
+	hist->len++;
+}
+
+// Returns the record of mapped entry i, or NULL if it would run off the map
+static const HistRecord* hist_map_record(CmdHist *hist, int i)
+{
+	uint64_t off = hist->map_index[i];
+	const HistRecord *rec;
+
+	if (off < sizeof(HistFileHeader) || off + sizeof(HistRecord) > hist->map_size)
+		return NULL;
+
+	rec = (const HistRecord *) (hist->map + off);
+	if (off + sizeof(HistRecord) + (uint64_t) rec->cwd_len + rec->cmd_len + 2 > hist->map_size)
+		return NULL;
+
+	return rec;
+}
+
+// i = 0 is the oldest entry. Returns NULL when out of range.
+const char* hist_get(CmdHist *hist, int i)
+{
+	const HistRecord *rec;
+
+	if (i < 0 || i >= hist->len)
+		return NULL;
+
+	if (i < hist->map_count) {
+		rec = hist_map_record(hist, i);
+		return rec ? (const char *) (rec + 1) + rec->cwd_len + 1 : "";
+	}
+
+	return hist->arena.data + hist->ents[i - hist->map_count].off;
+}
+
+int hist_get_meta(CmdHist *hist, int i, HistMeta *meta)
+{
+	const HistRecord *rec;
+	const HistEntry *ent;
+
+	if (i < 0 || i >= hist->len)
+		return -1;
+
+	if (i < hist->map_count) {
+		if ((rec = hist_map_record(hist, i)) == NULL)
+			return -1;
+		meta->when = rec->when;
+		meta->dur_us = rec->dur_us;
+		meta->status = rec->status;
+		meta->cwd = (const char *) (rec + 1);
+		return 0;
+	}
+
+	ent = hist->ents + (i - hist->map_count);
+	meta->when = ent->when;
+	meta->dur_us = ent->dur_us;
+	meta->status = ent->status;
+	meta->cwd = hist->arena.data + ent->cwd_off;
+	return 0;
+}
+
+void hist_free(CmdHist *hist)
+{
+	if (hist->map)
+		munmap((void *) hist->map, hist->map_size);
+	hist->map = NULL;
+	hist->map_index = NULL;
+	hist->map_size = 0;
+	hist->map_count = 0;
+
+	sb_free(&hist->arena);
+	free(hist->ents);
+	hist->ents = NULL;
+	hist->len = hist->nents = hist->cap = 0;
+	hist->arena_dead = 0;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = (const char *) buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int pwrite_all(int fd, const void *buf, size_t len, off_t off)
+{
+	const char *p = (const char *) buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = pwrite(fd, p, len, off);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		off += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+// Appends history entry i to out as an on-disk record
+static void hist_serialize(StrBuf *out, CmdHist *hist, int i)
+{
+	static const char pad[8] = {0};
+	HistRecord rec;
+	HistMeta meta;
+	const char *cmd = hist_get(hist, i);
+	size_t total;
+
+	memset(&rec, 0, sizeof(rec));
+	if (hist_get_meta(hist, i, &meta) < 0) {
+		meta.cwd = "";
+		meta.when = meta.dur_us = meta.status = 0;
+	}
+
+	rec.when = meta.when;
+	rec.dur_us = meta.dur_us;
+	rec.status = meta.status;
+	rec.cwd_len = strlen(meta.cwd);
+	rec.cmd_len = strlen(cmd);
+	total = sizeof(rec) + rec.cwd_len + rec.cmd_len + 2;
+
+	sb_reserve(out, total + 8);
+	sb_append(out, (const char *) &rec, sizeof(rec));
+	sb_append(out, meta.cwd, rec.cwd_len + 1);
+	sb_append(out, cmd, rec.cmd_len + 1);
+	sb_append(out, pad, (8 - total % 8) % 8);
+}
+
+// Writes len bytes of data to a temporary and renames it over path, so
+// readers that have the old file mapped or open are never disturbed
+static int replace_file(const char *path, const char *data, size_t len)
+{
+	char *tmp_path = (char *) malloc(strlen(path) + 8);
+	int fd, ret = -1;
+
+	sprintf(tmp_path, "%s.XXXXXX", path);
+	fd = mkstemp(tmp_path);
+	if (fd >= 0) {
+		if (pwrite_all(fd, data, len, 0) == 0 && fsync(fd) == 0
+			&& rename(tmp_path, path) == 0)
+			ret = 0;
+		else
+			unlink(tmp_path);
+		close(fd);
+	}
+
+	free(tmp_path);
+	return ret;
+}
+
+// Atomically replaces path with a binary history file holding entries
+// [first, first + n), see replace_file()
+int hist_file_rewrite(const char *path, CmdHist *hist, int first, int n)
+{
+	HistFileHeader hdr;
+	StrBuf buf = {0};
+	uint64_t *index;
+	uint64_t cap = HIST_INDEX_MIN;
+	int ret;
+
+	while (cap < (uint64_t) n * 2)
+		cap *= 2;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, HIST_MAGIC, sizeof(hdr.magic));
+	hdr.version = HIST_VERSION;
+	hdr.hdr_size = sizeof(hdr);
+	hdr.count = n;
+	hdr.index_off = sizeof(hdr);
+	hdr.index_cap = cap;
+
+	sb_reserve(&buf, sizeof(hdr) + cap * sizeof(uint64_t));
+	buf.len = sizeof(hdr) + cap * sizeof(uint64_t);
+	memset(buf.data, 0, buf.len);
+	for (int i = 0; i < n; i++) {
+		index = (uint64_t *) (buf.data + sizeof(hdr));
+		index[i] = buf.len;
+		hist_serialize(&buf, hist, first + i);
+	}
+	hdr.end = buf.len;
+	memcpy(buf.data, &hdr, sizeof(hdr));
+
+	ret = replace_file(path, buf.data, buf.len);
+	sb_free(&buf);
+	return ret;
+}
+
+// The same for a text history file, one command per line
+int hist_text_rewrite(const char *path, CmdHist *hist, int first, int n)
+{
+	StrBuf buf = {0};
+	const char *cmd;
+	int ret;
+
+	for (int i = first; i < first + n; i++) {
+		cmd = hist_get(hist, i);
+		sb_append(&buf, cmd, strlen(cmd));
+		sb_append(&buf, "\n", 1);
+	}
+	ret = replace_file(path, buf.data ? buf.data : "", buf.len);
+	sb_free(&buf);
+	return ret;
+}
+
+// Adds the lines of a text history file to hist
+static void hist_read_text(CmdHist *hist, const char *text, size_t size)
+{
+	const char *line = text, *end = text + size, *nl;
+	size_t len;
+
+	while (line < end) {
+		nl = (const char *) memchr(line, '\n', end - line);
+		len = (nl ? nl : end) - line;
+		if (len > 0 && line[len - 1] == '\r')
+			len--;
+		if (len > 0)
+			hist_push(hist, line, len, NULL);
+		line = nl ? nl + 1 : end;
+	}
+}
+
+// Appends entries [first, first + n) to the binary history file open on fd.
+// Records go at the end, then their index slots, then the header. A file
+// that is neither empty nor ours is left alone and -1 returned.
+int hist_file_append(int fd, CmdHist *hist, int first, int n)
+{
+	HistFileHeader hdr;
+	StrBuf recs = {0};
+	struct stat st;
+	uint64_t *offs, *index;
+	uint64_t end, cap;
+	int ret = -1;
+
+	if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)
+		|| memcmp(hdr.magic, HIST_MAGIC, sizeof(hdr.magic)) != 0) {
+		// Anything but an empty file is someone else's (a shell using the
+		// text format, say), leave it alone
+		if (fstat(fd, &st) < 0 || st.st_size != 0)
+			return -1;
+		// Lay down a header and an empty index
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, HIST_MAGIC, sizeof(hdr.magic));
+		hdr.version = HIST_VERSION;
+		hdr.hdr_size = sizeof(hdr);
+		hdr.index_off = sizeof(hdr);
+		hdr.index_cap = HIST_INDEX_MIN;
+		hdr.end = sizeof(hdr) + HIST_INDEX_MIN * sizeof(uint64_t);
+		if (ftruncate(fd, hdr.end) < 0)
+			return -1;
+	}
+	else if (hdr.version != HIST_VERSION) {
+		return -1;
+	}
+
+	offs = (uint64_t *) malloc(sizeof(uint64_t) * n);
+	for (int i = 0; i < n; i++) {
+		offs[i] = hdr.end + recs.len;
+		hist_serialize(&recs, hist, first + i);
+	}
+
+	end = hdr.end;
+	if (pwrite_all(fd, recs.data, recs.len, end) < 0)
+		goto out;
+	end += recs.len;
+
+	if (hdr.count + n > hdr.index_cap) {
+		// Out of index slots, append a bigger copy of the index
+		cap = hdr.index_cap * 2;
+		while (cap < hdr.count + n)
+			cap *= 2;
+		index = (uint64_t *) calloc(cap, sizeof(uint64_t));
+		if (pread(fd, index, hdr.count * sizeof(uint64_t), hdr.index_off)
+			!= (ssize_t) (hdr.count * sizeof(uint64_t))) {
+			free(index);
+			goto out;
+		}
+		memcpy(index + hdr.count, offs, n * sizeof(uint64_t));
+		if (pwrite_all(fd, index, cap * sizeof(uint64_t), end) < 0) {
+			free(index);
+			goto out;
+		}
+		free(index);
+		hdr.index_off = end;
+		hdr.index_cap = cap;
+		end += cap * sizeof(uint64_t);
+	}
+	else if (pwrite_all(fd, offs, n * sizeof(uint64_t),
+			hdr.index_off + hdr.count * sizeof(uint64_t)) < 0) {
+		goto out;
+	}
+
+	hdr.count += n;
+	hdr.end = end;
+	if (pwrite_all(fd, &hdr, sizeof(hdr), 0) == 0)
+		ret = 0;
+
+out:
+	free(offs);
+	sb_free(&recs);
+	return ret;
+}
+
+void exit_shell(Shell *shelly)
+{
+  free(shelly->cwd);
+	if (shelly->cwd_fd >= 0)
+		close(shelly->cwd_fd);
+	for (int i = 0; i < shelly->dir_stack_len; i++)
+		free(shelly->dir_stack[i]);
+	free(shelly->dir_stack);
+	dir_db_save(shelly);
+	dir_db_free(&shelly->dirs);
+	arena_free(&shelly->cmd_arena);
+	path_cache_clear(&path_cache);
+	flush_hist(shelly);
+	if (shelly->hist.fd >= 0)
+		close(shelly->hist.fd);
+	if (shelly->hist.compactor_started)
+		thrd_join(shelly->hist.compactor, NULL);
+  free(shelly->hist_filepath);
+
+	hist_free(&shelly->hist);
+	hist_index_free(&shelly->hist_index);
+
+	// Just let the children finish I guess 
+	free_jobs(shelly);
+	close(shelly->epoll_fd);
+	close(shelly->sigchld_fd);
+	free(shelly->main_input.buf);
+	prompt_free(&shelly->prompt);
+	compl_free(&shelly->compl);
+	sb_free(&shelly->line);
+	sb_free(&shelly->expanded);
+	vars_free();
+}
+  
+  
+// The HISTSIZE or HISTFILESIZE limit, -1 for none
+static int hist_limit(const char *name)
+{
+	const char *val = var_get(name);
+	char *end;
+	long n;
+
+	if (val == NULL || *val == '\0')
+		return HIST_SIZE_DEFAULT;
+	n = strtol(val, &end, 10);
+	if (*end != '\0')
+		return HIST_SIZE_DEFAULT;
+	return n < 0 ? -1 : n > INT32_MAX ? INT32_MAX : n;
+}
+
+// Whether HISTCONTROL has opt in it (ignoreboth counting as both ignores)
+static int hist_control(const char *opt)
+{
+	const char *val = var_get(ENV_HIST_CONTROL), *p, *end;
+	size_t len = strlen(opt);
+
+	if (val == NULL)
+		return 0;
+	for (p = val; *p; p = *end ? end + 1 : end) {
+		end = strchrnul(p, ':');
+		if ((size_t) (end - p) == len && memcmp(p, opt, len) == 0)
+			return 1;
+		if (end - p == 10 && memcmp(p, "ignoreboth", 10) == 0 && strncmp(opt, "ignore", 6) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+// Entries from dropped on were renumbered: the search index just moves its
+// base for ones dropped from the front, ones from the middle make it rebuild
+// at the next search. Completion moves back with them.
+static void hist_renumbered(Shell *shelly, int from, int dropped)
+{
+	ComplSrc *words = &shelly->compl.hist;
+
+	if (from == 0)
+		shelly->hist_index.base += dropped;
+	else
+		shelly->hist_index.stale = 1;
+	if (words->seen > from)
+		words->seen = words->seen - dropped > from ? words->seen - dropped : from;
+}
+
+// Takes the earlier copies of cmd out of this session's entries. Ones from the
+// hist file go when it's compacted.
+static void hist_erase(Shell *shelly, const char *cmd)
+{
+	CmdHist *hist = &shelly->hist;
+	size_t len = strlen(cmd);
+	HistEntry *ent;
+	int id;
+
+	for (int i = hist->nents - 1; i >= 0; i--) {
+		ent = hist->ents + i;
+		if (ent->len != len || memcmp(hist->arena.data + ent->off, cmd, len) != 0)
+			continue;
+
+		id = hist->map_count + i;
+		hist->arena_dead += ent->len + strlen(hist->arena.data + ent->cwd_off) + 2;
+		memmove(ent, ent + 1, sizeof(HistEntry) * (hist->nents - i - 1));
+		hist->nents--;
+		hist->len--;
+		if (id < hist->flushed)
+			hist->flushed--;
+		hist_renumbered(shelly, id, 1);
+	}
+}
+
+// Drops the oldest drop arena entries and copies the rest to a fresh arena,
+// which also gets rid of erased ones
+static void hist_pack(CmdHist *hist, int drop)
+{
+	StrBuf arena = {0};
+	HistEntry *ent;
+	size_t cwd_len;
+
+	sb_reserve(&arena, hist->arena.len - hist->arena_dead);
+	for (int i = drop; i < hist->nents; i++) {
+		ent = hist->ents + i;
+		cwd_len = strlen(hist->arena.data + ent->cwd_off);
+		hist->ents[i - drop] = *ent;
+		ent = hist->ents + i - drop;
+		sb_append(&arena, hist->arena.data + hist->ents[i].off, hist->ents[i].len + 1);
+		ent->off = arena.len - hist->ents[i].len - 1;
+		ent->cwd_off = arena.len;
+		sb_append(&arena, hist->arena.data + hist->ents[i].cwd_off, cwd_len + 1);
+	}
+
+	sb_free(&hist->arena);
+	hist->arena = arena;
+	hist->arena_dead = 0;
+	hist->nents -= drop;
+	hist->len -= drop;
+}
+
+// Keeps the history to HISTSIZE entries, dropping the oldest ones that have
+// been written out. Mapped entries cost nothing to drop; arena entries are
+// dropped in batches since the rest have to be copied.
+static void hist_trim(Shell *shelly)
+{
+	CmdHist *hist = &shelly->hist;
+	int limit = hist_limit(ENV_HIST_SIZE);
+	int drop = 0, mapped = 0;
+
+	if (limit >= 0 && hist->len > limit)
+		drop = hist->len - limit < hist->flushed ? hist->len - limit : hist->flushed;
+
+	mapped = drop < hist->map_count ? drop : hist->map_count;
+	hist->map_index += mapped;
+	hist->map_count -= mapped;
+	hist->len -= mapped;
+	hist->flushed -= mapped;
+	if (hist->map && hist->map_count == 0) {
+		munmap((void *) hist->map, hist->map_size);
+		hist->map = NULL;
+		hist->map_index = NULL;
+		hist->map_size = 0;
+	}
+
+	drop -= mapped;
+	if (drop < limit / 8 + 16)
+		drop = 0;
+	if (drop > 0 || (hist->arena_dead > 0 && hist->arena_dead >= hist->arena.len / 2)) {
+		hist_pack(hist, drop);
+		hist->flushed -= drop;
+	}
+
+	if (mapped + drop > 0)
+		hist_renumbered(shelly, 0, mapped + drop);
+}
+
+typedef struct HistCompact {
+	char *path;
+	int limit;
+	int erase_dups;
+	atomic_int *done;
+} HistCompact;
+
+// Rewrites the hist file at path, binary or text, with its newest limit
+// entries (the newest copy of each command only, with erase_dups). Runs under
+// the write lock so no other shell appends in the meantime, and renames the
+// new file into place, so shells that have the old one mapped or open carry
+// on; they notice the new inode the next time they lock it.
+static int hist_compact_file(const char *path, int limit, int erase_dups)
+{
+	const HistFileHeader *hdr;
+	struct stat fd_st, path_st;
+	const char **seen = NULL, *cmd;
+	const char *map = (const char *) MAP_FAILED;
+	CmdHist src, kept;
+	HistMeta meta;
+	uint32_t mask, h;
+	int *ids = NULL;
+	int fd, count, text = 0, n = 0, ret = -1;
+	int (*rewrite)(const char *, CmdHist *, int, int) = hist_file_rewrite;
+
+	memset(&src, 0, sizeof(src));
+	memset(&kept, 0, sizeof(kept));
+	while (1) {
+		if ((fd = open(path, O_RDWR | O_CLOEXEC)) < 0)
+			return -1;
+		if (flock(fd, LOCK_EX) == 0 && fstat(fd, &fd_st) == 0 && stat(path, &path_st) == 0
+			&& fd_st.st_dev == path_st.st_dev && fd_st.st_ino == path_st.st_ino)
+			break;
+		close(fd);
+	}
+
+	if (fd_st.st_size == 0)
+		goto out;
+	map = (const char *) mmap(NULL, fd_st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		goto out;
+	hdr = (const HistFileHeader *) map;
+	text = (size_t) fd_st.st_size < sizeof(HistFileHeader)
+		|| memcmp(hdr->magic, HIST_MAGIC, sizeof(hdr->magic)) != 0;
+	if (text) {
+		// Stays text, it's what the shells writing it asked for
+		hist_read_text(&src, map, fd_st.st_size);
+		rewrite = hist_text_rewrite;
+	}
+	else {
+		if (hdr->version != HIST_VERSION || hdr->count > INT32_MAX
+			|| hdr->index_off + hdr->count * sizeof(uint64_t) > (uint64_t) fd_st.st_size)
+			goto out;
+		src.map = map;
+		src.map_size = fd_st.st_size;
+		src.map_index = (const uint64_t *) (map + hdr->index_off);
+		src.map_count = src.len = hdr->count;
+	}
+	count = src.len;
+
+	if (!erase_dups) {
+		// Another shell may have got here first
+		ret = count <= limit ? 0 : rewrite(path, &src, count - limit, limit);
+		goto out;
+	}
+
+	// Newest first, keeping the first copy of each command
+	for (mask = 1; mask < (uint32_t) (count < limit ? count : limit) * 2; mask <<= 1)
+		;
+	seen = (const char **) calloc(mask--, sizeof(char *));
+	ids = (int *) malloc(sizeof(int) * ((count < limit ? count : limit) + 1));
+	for (int i = count - 1; i >= 0 && n < limit; i--) {
+		cmd = hist_get(&src, i);
+		for (h = hash_str(cmd) & mask; seen[h] && strcmp(seen[h], cmd) != 0; h = (h + 1) & mask)
+			;
+		if (seen[h])
+			continue;
+		seen[h] = cmd;
+		ids[n++] = i;
+	}
+	while (n-- > 0) {
+		if (hist_get_meta(&src, ids[n], &meta) < 0) {
+			meta.cwd = "";
+			meta.when = meta.dur_us = meta.status = 0;
+		}
+		cmd = hist_get(&src, ids[n]);
+		hist_push(&kept, cmd, strlen(cmd), &meta);
+	}
+	ret = rewrite(path, &kept, 0, kept.len);
+
+out:
+	// A binary file's map is src's and goes with it
+	if (map != MAP_FAILED && src.map == NULL)
+		munmap((void *) map, fd_st.st_size);
+	hist_free(&src);
+	hist_free(&kept);
+	free(seen);
+	free(ids);
+	flock(fd, LOCK_UN);
+	close(fd);
+	return ret;
+}
+
+static int hist_compact_thread(void *arg)
+{
+	HistCompact *job = (HistCompact *) arg;
+
+	hist_compact_file(job->path, job->limit, job->erase_dups);
+	atomic_store(job->done, 0);
+	free(job->path);
+	free(job);
+	return 0;
+}
+
+// Starts compacting the hist file in the background once it has a quarter
+// more entries than HISTFILESIZE, so it's rewritten now and then rather than
+// on every write. A text file's count is only our estimate, so it's taken to
+// be down to the limit once its compaction starts.
+static void hist_maybe_compact(Shell *shelly, uint64_t count)
+{
+	CmdHist *hist = &shelly->hist;
+	int limit = hist_limit(ENV_HIST_FILE_SIZE);
+	HistCompact *job;
+
+	if (limit < 0 || count <= (uint64_t) limit + limit / 4 + 16
+		|| atomic_load(&hist->compacting))
+		return;
+	if (hist->compactor_started)
+		thrd_join(hist->compactor, NULL);
+	hist->compactor_started = 0;
+
+	job = (HistCompact *) malloc(sizeof(HistCompact));
+	job->path = strdup(shelly->hist_filepath);
+	job->limit = limit;
+	job->erase_dups = hist_control("erasedups");
+	job->done = &hist->compacting;
+	atomic_store(&hist->compacting, 1);
+	if (thrd_create(&hist->compactor, hist_compact_thread, job) != thrd_success) {
+		atomic_store(&hist->compacting, 0);
+		free(job->path);
+		free(job);
+		return;
+	}
+	hist->compactor_started = 1;
+	if (!hist->binary)
+		hist->text_lines = limit;
+}
+
+// Loads the history file open on fd. A binary file is mapped and used in
+// place; a legacy text file is read line by line and, unless the text format
+// was asked for, migrated to the binary format.
+void read_hist_file(Shell *shelly, int fd)
+{
+	CmdHist *hist = &shelly->hist;
+	const HistFileHeader *hdr;
+	struct stat st;
+	const char *map;
+
+	// Writers hold an exclusive lock while appending, wait for them so the
+	// header is consistent. Exclusive ourselves in case this is a text file
+	// that gets migrated.
+	flock(fd, hist->binary ? LOCK_EX : LOCK_SH);
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		flock(fd, LOCK_UN);
+		return;
+	}
+
+	map = (const char *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		flock(fd, LOCK_UN);
+		return;
+	}
+
+	hdr = (const HistFileHeader *) map;
+	if ((size_t) st.st_size >= sizeof(HistFileHeader)
+		&& memcmp(hdr->magic, HIST_MAGIC, sizeof(hdr->magic)) == 0) {
+		if (hdr->version != HIST_VERSION || hdr->count > INT32_MAX
+			|| hdr->index_off + hdr->count * sizeof(uint64_t) > (uint64_t) st.st_size) {
+			printf("Ignoring corrupt history file %s\n", shelly->hist_filepath);
+			munmap((void *) map, st.st_size);
+			flock(fd, LOCK_UN);
+			return;
+		}
+
+		hist->map = map;
+		hist->map_size = st.st_size;
+		hist->map_index = (const uint64_t *) (map + hdr->index_off);
+		hist->map_count = hdr->count;
+		hist->len = hist->map_count;
+		hist->flushed = hist->len;
+		flock(fd, LOCK_UN);
+		return;
+	}
+
+	// Legacy text file, one command per line
+	hist_read_text(hist, map, st.st_size);
+	hist->text_lines = hist->len;
+	munmap((void *) map, st.st_size);
+
+	if (hist->binary && hist_file_rewrite(shelly->hist_filepath, hist, 0, hist->len) < 0)
+		printf("Unable to migrate history file %s\n", shelly->hist_filepath);
+	hist->flushed = hist->len;
+	flock(fd, LOCK_UN);
+}
+
+// Reads the hist file the first time the history is needed. Entries added
+// before that stay in memory and go after the file's.
+void load_hist(Shell *shelly)
+{
+	CmdHist *hist = &shelly->hist;
+	CmdHist added;
+	HistMeta meta;
+	const char *cmd;
+	int fd;
+
+	if (hist->loaded)
+		return;
+	hist->loaded = 1;
+
+	// Nothing has been mapped yet, so these are all arena entries
+	memset(&added, 0, sizeof(added));
+	added.arena = hist->arena;
+	added.ents = hist->ents;
+	added.nents = added.len = hist->nents;
+	memset(&hist->arena, 0, sizeof(hist->arena));
+	hist->ents = NULL;
+	hist->nents = hist->cap = hist->len = hist->flushed = 0;
+
+	fd = open(shelly->hist_filepath, O_RDONLY | O_CLOEXEC);
+	if (fd >= 0) {
+		read_hist_file(shelly, fd);
+		close(fd);
+	}
+
+	for (int i = 0; i < added.len; i++) {
+		cmd = hist_get(&added, i);
+		hist_get_meta(&added, i, &meta);
+		hist_push(hist, cmd, strlen(cmd), &meta);
+	}
+	hist_free(&added);
+	hist_trim(shelly);
+}
+
+// Opens the hist file if needed and takes the exclusive write lock. Another
+// shell may have swapped the file out from under us (history -c, migration),
+// in which case we locked a stale inode and have to reopen.
+static int hist_lock(Shell *shelly)
+{
+	CmdHist *hist = &shelly->hist;
+	struct stat fd_st, path_st;
+	int flags = O_RDWR | O_CREAT | O_CLOEXEC | (hist->binary ? 0 : O_APPEND);
+
+	while (1) {
+		if (hist->fd < 0) {
+			hist->fd = open(shelly->hist_filepath, flags, S_IRUSR | S_IWUSR);
+			if (hist->fd < 0)
+				return -1;
+		}
+
+		if (flock(hist->fd, LOCK_EX) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		if (fstat(hist->fd, &fd_st) == 0 && stat(shelly->hist_filepath, &path_st) == 0
+			&& fd_st.st_dev == path_st.st_dev && fd_st.st_ino == path_st.st_ino)
+			return 0;
+
+		close(hist->fd);
+		hist->fd = -1;
+	}
+}
+
+static void hist_unlock(Shell *shelly)
+{
+	flock(shelly->hist.fd, LOCK_UN);
+}
+
+// Writes all finished but unwritten entries to the hist file
+void flush_hist(Shell *shelly)
+{
+	CmdHist *hist = &shelly->hist;
+	StrBuf lines = {0};
+	HistFileHeader hdr;
+	uint64_t file_count = 0;
+	const char *cmd;
+
+	if (hist->flushed >= hist->len)
+		return;
+	// A text file has to be migrated before binary records go on the end
+	load_hist(shelly);
+
+	if (hist_lock(shelly) < 0) {
+		printf("Unable to write history file %s\n", shelly->hist_filepath);
+		hist->flushed = hist->len;
+		return;
+	}
+
+	if (hist->binary) {
+		if (hist_file_append(hist->fd, hist, hist->flushed, hist->len - hist->flushed) < 0)
+			printf("Unable to write history file %s\n", shelly->hist_filepath);
+		else if (pread(hist->fd, &hdr, sizeof(hdr), 0) == sizeof(hdr))
+			file_count = hdr.count;
+	}
+	else {
+		for (int i = hist->flushed; i < hist->len; i++) {
+			cmd = hist_get(hist, i);
+			sb_append(&lines, cmd, strlen(cmd));
+			sb_append(&lines, "\n", 1);
+		}
+		// O_APPEND and the lock keep other shells' lines from interleaving
+		if (write(hist->fd, lines.data, lines.len) < 0) {
+			printf("Unable to write history file %s\n", shelly->hist_filepath);
+		}
+		else {
+			hist->text_lines += hist->len - hist->flushed;
+			file_count = hist->text_lines;
+		}
+		sb_free(&lines);
+	}
+
+	if (hist->fsync)
+		fsync(hist->fd);
+	hist_unlock(shelly);
+	hist->flushed = hist->len;
+
+	hist_maybe_compact(shelly, file_count);
+	hist_trim(shelly);
+}
+
+void add_to_hist(Shell *shelly, char *buf)
+{
+	CmdHist *hist = &shelly->hist;
+	const char *prev;
+	HistMeta meta;
+
+	if (buf[0] == ' ' && hist_control("ignorespace"))
+		return;
+	prev = hist->len > 0 ? hist_get(hist, hist->len - 1) : NULL;
+	if (prev && strcmp(prev, buf) == 0 && hist_control("ignoredups"))
+		return;
+	if (hist_control("erasedups"))
+		hist_erase(shelly, buf);
+
+	meta.when = time(NULL);
+	meta.dur_us = 0;
+	meta.status = 0;
+	meta.cwd = shelly->cwd;
+
+	// Add to shelly hist list
+	hist_push(&shelly->hist, buf, strlen(buf), &meta);
+	shelly->hist.start_ns = now_ns();
+	shelly->hist.running = 1;
+	// Only kept up to date once something has searched, and not while it's
+	// waiting for a rebuild
+	if (shelly->hist_index.slots && !shelly->hist_index.stale)
+		hist_index_update(shelly);
+}
+
+// Called once the newest history entry finished running: records how it went
+// and writes it to the hist file
+void finish_hist(Shell *shelly, int status)
+{
+	CmdHist *hist = &shelly->hist;
+	HistEntry *ent;
+	int64_t now;
+
+	// Nothing was added for it (HISTCONTROL) or it's been cleared
+	if (!hist->running || hist->nents == 0)
+		return;
+	hist->running = 0;
+
+	ent = hist->ents + hist->nents - 1;
+	now = now_ns();
+	ent->dur_us = (now - hist->start_ns) / 1000;
+	ent->status = status;
+
+	if (hist->len - hist->flushed == 1)
+		hist->pending_ns = now;
+
+	// Write to hist file
+	if (hist->len - hist->flushed >= hist->batch
+		|| now - hist->pending_ns >= HIST_FLUSH_MAX_AGE_NS)
+		flush_hist(shelly);
+}
+
+#define HIST_GRAM(p) ((uint32_t) (unsigned char) (p)[0] << 16 \
+	| (uint32_t) (unsigned char) (p)[1] << 8 | (unsigned char) (p)[2])
+
+// The list for gram, a new empty one if add is set, NULL if there isn't one
+static HistPosting* hist_index_slot(HistIndex *index, uint32_t gram, int add)
+{
+	HistPosting *old;
+	uint32_t i;
+	int old_cap;
+
+	if (add && (index->num + 1) * 2 > index->cap) {
+		old = index->slots;
+		old_cap = index->cap;
+		index->cap = old_cap * 2;
+		index->slots = (HistPosting *) calloc(index->cap, sizeof(HistPosting));
+		for (int j = 0; j < old_cap; j++) {
+			if (old[j].gram == 0)
+				continue;
+			for (i = (old[j].gram * 2654435761u) & (index->cap - 1); index->slots[i].gram;
+				i = (i + 1) & (index->cap - 1))
+				;
+			index->slots[i] = old[j];
+		}
+		free(old);
+	}
+	if (index->slots == NULL)
+		return NULL;
+
+	for (i = (gram * 2654435761u) & (index->cap - 1); index->slots[i].gram;
+		i = (i + 1) & (index->cap - 1)) {
+		if (index->slots[i].gram == gram)
+			return index->slots + i;
+	}
+	if (!add)
+		return NULL;
+	index->slots[i].gram = gram;
+	index->num++;
+	return index->slots + i;
+}
+
+static void hist_index_entry(HistIndex *index, int id, const char *cmd)
+{
+	HistPosting *post;
+	uint32_t delta;
+	size_t len = strlen(cmd);
+
+	for (size_t i = 0; i + 3 <= len; i++) {
+		post = hist_index_slot(index, HIST_GRAM(cmd + i), 1);
+		// A trigram that's in the entry twice
+		if (post->count > 0 && post->last == id)
+			continue;
+
+		if (post->len + 5 > post->cap) {
+			post->cap = post->cap ? post->cap * 2 : 8;
+			post->ids = (uint8_t *) realloc(post->ids, post->cap);
+		}
+		for (delta = id - (post->count ? post->last : 0); delta >= 0x80; delta >>= 7)
+			post->ids[post->len++] = delta | 0x80;
+		post->ids[post->len++] = delta;
+		post->last = id;
+		post->count++;
+	}
+}
+
+// Indexes the entries added since the last time, all of them the first time
+// and once the lists hold more dropped entries than live ones
+void hist_index_update(Shell *shelly)
+{
+	HistIndex *index = &shelly->hist_index;
+	CmdHist *hist = &shelly->hist;
+
+	if (index->stale || index->base > index->indexed - index->base)
+		hist_index_free(index);
+	if (index->slots == NULL) {
+		index->cap = 4096;
+		index->slots = (HistPosting *) calloc(index->cap, sizeof(HistPosting));
+	}
+	for (; index->indexed < hist->len + index->base; index->indexed++)
+		hist_index_entry(index, index->indexed, hist_get(hist, index->indexed - index->base));
+}
+
+void hist_index_free(HistIndex *index)
+{
+	for (int i = 0; i < index->cap; i++)
+		free(index->slots[i].ids);
+	free(index->slots);
+	free(index->pat);
+	free(index->cands);
+	memset(index, 0, sizeof(*index));
+}
+
+// Keeps the ids in cands[0, n) that are also in post, returns how many
+static int hist_posting_intersect(const HistPosting *post, int *cands, int n)
+{
+	uint32_t off = 0, delta;
+	int id = 0, kept = 0, j = 0, shift;
+
+	while (off < post->len && j < n) {
+		for (delta = 0, shift = 0; post->ids[off] & 0x80; shift += 7)
+			delta |= (uint32_t) (post->ids[off++] & 0x7f) << shift;
+		delta |= (uint32_t) post->ids[off++] << shift;
+		id += delta;
+
+		while (j < n && cands[j] < id)
+			j++;
+		if (j < n && cands[j] == id)
+			cands[kept++] = cands[j++];
+	}
+	return kept;
+}
+
+// Works out which entries could contain pat from its trigrams
+static void hist_index_candidates(HistIndex *index, const char *pat, size_t len)
+{
+	HistPosting *post, *smallest = NULL;
+	uint32_t off = 0, delta;
+	int id = 0, shift;
+
+	free(index->pat);
+	index->pat = strndup(pat, len);
+	index->cands_at = index->indexed;
+	index->num_cands = 0;
+
+	for (size_t i = 0; i + 3 <= len; i++) {
+		if ((post = hist_index_slot(index, HIST_GRAM(pat + i), 0)) == NULL)
+			return;
+		if (smallest == NULL || post->count < smallest->count)
+			smallest = post;
+	}
+
+	index->cands = (int *) realloc(index->cands, sizeof(int) * (smallest->count + 1));
+	while (off < smallest->len) {
+		for (delta = 0, shift = 0; smallest->ids[off] & 0x80; shift += 7)
+			delta |= (uint32_t) (smallest->ids[off++] & 0x7f) << shift;
+		delta |= (uint32_t) smallest->ids[off++] << shift;
+		id += delta;
+		index->cands[index->num_cands++] = id;
+	}
+
+	// Lists much longer than what's left cost more to walk than checking
+	// the candidates does
+	for (size_t i = 0; i + 3 <= len && index->num_cands > 0; i++) {
+		post = hist_index_slot(index, HIST_GRAM(pat + i), 0);
+		if (post != smallest && post->count <= index->num_cands * 32)
+			index->num_cands = hist_posting_intersect(post, index->cands, index->num_cands);
+	}
+}
+
+// Finds up to max entries older than before that contain pat (len bytes),
+// newest first, and puts their numbers in out. Returns how many were found.
+int hist_search(Shell *shelly, const char *pat, size_t len, int before, int *out, int max)
+{
+	HistIndex *index = &shelly->hist_index;
+	CmdHist *hist = &shelly->hist;
+	const char *cmd;
+	int n = 0, lo, hi, mid;
+
+	load_hist(shelly);
+	hist_index_update(shelly);
+	if (before > hist->len)
+		before = hist->len;
+
+	// Too short to have a trigram, look at everything
+	if (len < 3) {
+		for (int i = before - 1; i >= 0 && n < max; i--) {
+			cmd = hist_get(hist, i);
+			if (memmem(cmd, strlen(cmd), pat, len))
+				out[n++] = i;
+		}
+		return n;
+	}
+
+	if (index->pat == NULL || index->cands_at != index->indexed
+		|| strlen(index->pat) != len || memcmp(index->pat, pat, len) != 0)
+		hist_index_candidates(index, pat, len);
+
+	// First candidate that isn't older than before. Ones below base have been
+	// dropped.
+	before += index->base;
+	for (lo = 0, hi = index->num_cands; lo < hi; ) {
+		mid = (lo + hi) / 2;
+		if (index->cands[mid] < before)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	while (--lo >= 0 && n < max && index->cands[lo] >= index->base) {
+		cmd = hist_get(hist, index->cands[lo] - index->base);
+		if (memmem(cmd, strlen(cmd), pat, len))
+			out[n++] = index->cands[lo] - index->base;
+	}
+	return n;
+}
+
+static void trie_init(Trie *trie)
+{
+	trie->cap = 64;
+	trie->nodes = (TrieNode *) calloc(trie->cap, sizeof(TrieNode));
+	trie->num_nodes = 1;
+	trie->dead = 0;
+}
+
+static void trie_free(Trie *trie)
+{
+	free(trie->nodes);
+	memset(trie, 0, sizeof(*trie));
+}
+
+static int trie_node(Trie *trie, char c, int sibling)
+{
+	TrieNode *node;
+
+	if (trie->num_nodes == trie->cap) {
+		trie->cap *= 2;
+		trie->nodes = (TrieNode *) realloc(trie->nodes, sizeof(TrieNode) * trie->cap);
+	}
+	node = trie->nodes + trie->num_nodes;
+	memset(node, 0, sizeof(*node));
+	node->c = c;
+	node->sibling = sibling;
+	// Until trie_count() gets to it
+	trie->dead++;
+	return trie->num_nodes++;
+}
+
+// Adds or subtracts one word from the counts along its path
+static void trie_count(Trie *trie, const char *word, size_t len, int delta)
+{
+	int n = 0;
+
+	trie->nodes[0].words += delta;
+	for (size_t i = 0; i < len; i++) {
+		for (n = trie->nodes[n].child; trie->nodes[n].c != word[i]; )
+			n = trie->nodes[n].sibling;
+		trie->nodes[n].words += delta;
+		if (trie->nodes[n].words == 0)
+			trie->dead++;
+		else if (trie->nodes[n].words == 1 && delta > 0)
+			trie->dead--;
+	}
+}
+
+static void trie_insert(Trie *trie, const char *word, size_t len)
+{
+	int n = 0, prev, next;
+
+	if (trie->nodes == NULL)
+		trie_init(trie);
+
+	for (size_t i = 0; i < len; i++) {
+		// Find the child for word[i], or where it goes among its siblings
+		prev = 0;
+		next = trie->nodes[n].child;
+		while (next && (unsigned char) trie->nodes[next].c < (unsigned char) word[i]) {
+			prev = next;
+			next = trie->nodes[next].sibling;
+		}
+		if (next == 0 || trie->nodes[next].c != word[i]) {
+			next = trie_node(trie, word[i], next);
+			if (prev)
+				trie->nodes[prev].sibling = next;
+			else
+				trie->nodes[n].child = next;
+		}
+		n = next;
+	}
+	if (trie->nodes[n].ends++ == 0)
+		trie_count(trie, word, len, 1);
+}
+
+// The node for prefix, -1 if no word starts with it
+static int trie_find(Trie *trie, const char *prefix, size_t len)
+{
+	int n = 0;
+
+	if (trie->nodes == NULL)
+		return -1;
+	for (size_t i = 0; i < len; i++) {
+		for (n = trie->nodes[n].child; n && trie->nodes[n].c != prefix[i]; )
+			n = trie->nodes[n].sibling;
+		if (n == 0 || trie->nodes[n].words == 0)
+			return -1;
+	}
+	return trie->nodes[n].words > 0 ? n : -1;
+}
+
+static void trie_remove(Trie *trie, const char *word, size_t len)
+{
+	int n;
+
+	if ((n = trie_find(trie, word, len)) < 0 || trie->nodes[n].ends == 0)
+		return;
+	if (--trie->nodes[n].ends == 0)
+		trie_count(trie, word, len, -1);
+}
+
+// Calls fn on every word below node n, in order, with word holding the path
+// to n. Stops early once fn returns nonzero.
+static int trie_walk(Trie *trie, int n, StrBuf *word,
+	int (*fn)(void *arg, const char *word, size_t len), void *arg)
+{
+	size_t len = word->len;
+
+	if (trie->nodes[n].ends > 0 && fn(arg, word->data, word->len))
+		return 1;
+	for (int c = trie->nodes[n].child; c; c = trie->nodes[c].sibling) {
+		if (trie->nodes[c].words == 0)
+			continue;
+		sb_append(word, &trie->nodes[c].c, 1);
+		if (trie_walk(trie, c, word, fn, arg))
+			return 1;
+		word->len = len;
+	}
+	return 0;
+}
+
+static int trie_copy_word(void *arg, const char *word, size_t len)
+{
+	trie_insert((Trie *) arg, word, len);
+	return 0;
+}
+
+// Rebuilds the trie without its dead nodes once they're most of it
+static void trie_compact(Trie *trie)
+{
+	Trie fresh = {0};
+	StrBuf word = {0};
+
+	if (trie->nodes == NULL || trie->dead * 2 < trie->num_nodes)
+		return;
+	trie_init(&fresh);
+	trie_walk(trie, 0, &word, trie_copy_word, &fresh);
+	sb_free(&word);
+	trie_free(trie);
+	*trie = fresh;
+}
+
+// What all the words starting with prefix have in common after it
+static void trie_common(Trie *trie, int n, StrBuf *out)
+{
+	int c, only;
+
+	while (trie->nodes[n].ends == 0) {
+		only = 0;
+		for (c = trie->nodes[n].child; c; c = trie->nodes[c].sibling) {
+			if (trie->nodes[c].words == 0)
+				continue;
+			if (only)
+				return;
+			only = c;
+		}
+		if (only == 0)
+			return;
+		sb_append(out, &trie->nodes[only].c, 1);
+		n = only;
+	}
+}
+
+static void compl_dir_free(ComplDir *dir)
+{
+	free(dir->path);
+	sb_free(&dir->names);
+}
+
+// Lists dir into dir->names and the trie. Only executables when exec_only,
+// directories get a '/' on the end otherwise.
+static void compl_scan_dir(Trie *trie, ComplDir *dir, int exec_only)
+{
+	DIR *d = opendir(dir->path);
+	struct dirent *ent;
+	struct stat st;
+	size_t len;
+	int is_dir;
+
+	dir->names.len = 0;
+	stat_mtime(dir->path, &dir->mtime);
+	if (d == NULL)
+		return;
+
+	while ((ent = readdir(d)) != NULL) {
+		if (ent->d_name[0] == '.' && (ent->d_name[1] == '\0'
+			|| (ent->d_name[1] == '.' && ent->d_name[2] == '\0')))
+			continue;
+
+		is_dir = ent->d_type == DT_DIR;
+		if (ent->d_type == DT_LNK || ent->d_type == DT_UNKNOWN) {
+			if (fstatat(dirfd(d), ent->d_name, &st, 0) < 0)
+				continue;
+			is_dir = S_ISDIR(st.st_mode);
+		}
+		if (exec_only && (is_dir || faccessat(dirfd(d), ent->d_name, X_OK, 0) < 0))
+			continue;
+
+		len = strlen(ent->d_name);
+		sb_append(&dir->names, ent->d_name, len);
+		if (is_dir && !exec_only)
+			sb_append(&dir->names, "/", 1);
+		trie_insert(trie, dir->names.data + dir->names.len - len - (is_dir && !exec_only),
+			len + (is_dir && !exec_only));
+		sb_append(&dir->names, "", 1);
+	}
+	closedir(d);
+}
+
+// Takes dir's names back out of the trie
+static void compl_unscan_dir(Trie *trie, ComplDir *dir)
+{
+	size_t len;
+
+	for (size_t off = 0; off < dir->names.len; off += len + 1) {
+		len = strlen(dir->names.data + off);
+		trie_remove(trie, dir->names.data + off, len);
+	}
+	dir->names.len = 0;
+}
+
+static void compl_src_free(ComplSrc *src)
+{
+	trie_free(&src->trie);
+	for (int i = 0; i < src->num_dirs; i++)
+		compl_dir_free(src->dirs + i);
+	free(src->dirs);
+	free(src->key);
+	src->dirs = NULL;
+	src->num_dirs = 0;
+	src->key = NULL;
+	src->seen = 0;
+}
+
+static void refresh_builtins(Shell *shelly, ComplSrc *src, const char *dir)
+{
+	if (src->trie.nodes)
+		return;
+	trie_init(&src->trie);
+	for (int i = 0; builtin_cmds[i].cmd_name != NULL; i++)
+		trie_insert(&src->trie, builtin_cmds[i].cmd_name, strlen(builtin_cmds[i].cmd_name));
+}
+
+// Executables on PATH. Only directories whose mtime changed are read again.
+static void refresh_path(Shell *shelly, ComplSrc *src, const char *unused)
+{
+	const char *path_env = var_get("PATH"), *dir, *end;
+	struct timespec mtime;
+	ComplDir *d;
+
+	if (path_env == NULL)
+		path_env = "/usr/local/bin:/usr/bin:/bin";
+
+	if (src->key == NULL || strcmp(src->key, path_env) != 0) {
+		compl_src_free(src);
+		trie_init(&src->trie);
+		src->key = strdup(path_env);
+		for (dir = path_env; *dir; dir = *end ? end + 1 : end) {
+			end = strchrnul(dir, ':');
+			if (end == dir)
+				continue;
+			src->dirs = (ComplDir *) realloc(src->dirs, sizeof(ComplDir) * (src->num_dirs + 1));
+			d = src->dirs + src->num_dirs++;
+			memset(d, 0, sizeof(*d));
+			d->path = strndup(dir, end - dir);
+			compl_scan_dir(&src->trie, d, 1);
+		}
+		return;
+	}
+
+	for (int i = 0; i < src->num_dirs; i++) {
+		d = src->dirs + i;
+		stat_mtime(d->path, &mtime);
+		if (mtime.tv_sec == d->mtime.tv_sec && mtime.tv_nsec == d->mtime.tv_nsec)
+			continue;
+		compl_unscan_dir(&src->trie, d);
+		compl_scan_dir(&src->trie, d, 1);
+	}
+	trie_compact(&src->trie);
+}
+
+// Entries of the directory being completed in, kept until it changes
+static void refresh_files(Shell *shelly, ComplSrc *src, const char *dir)
+{
+	struct timespec mtime;
+
+	stat_mtime(dir, &mtime);
+	if (src->num_dirs == 1 && strcmp(src->dirs[0].path, dir) == 0
+		&& mtime.tv_sec == src->dirs[0].mtime.tv_sec
+		&& mtime.tv_nsec == src->dirs[0].mtime.tv_nsec)
+		return;
+
+	compl_src_free(src);
+	trie_init(&src->trie);
+	src->dirs = (ComplDir *) calloc(1, sizeof(ComplDir));
+	src->num_dirs = 1;
+	src->dirs[0].path = strdup(dir);
+	compl_scan_dir(&src->trie, src->dirs, 0);
+}
+
+static void refresh_vars(Shell *shelly, ComplSrc *src, const char *dir)
+{
+	if (src->trie.nodes && src->seen == vars.version)
+		return;
+	compl_src_free(src);
+	trie_init(&src->trie);
+	for (int i = 0; i < vars.cap; i++) {
+		if (vars.slots[i].name)
+			trie_insert(&src->trie, vars.slots[i].name, strlen(vars.slots[i].name));
+	}
+	src->seen = vars.version;
+}
+
+// Words from the newest history entries, new entries are added as they come
+static void refresh_hist(Shell *shelly, ComplSrc *src, const char *dir)
+{
+	CmdHist *hist = &shelly->hist;
+	const char *cmd, *word;
+	int i;
+
+	load_hist(shelly);
+	if (src->trie.nodes == NULL) {
+		trie_init(&src->trie);
+		src->seen = hist->len > COMPL_HIST_ENTRIES ? hist->len - COMPL_HIST_ENTRIES : 0;
+	}
+	// history -c empties it
+	if (src->seen > hist->len)
+		src->seen = hist->len;
+
+	for (i = src->seen; i < hist->len; i++) {
+		for (cmd = hist_get(hist, i); *cmd; ) {
+			while (IS_WHITESPACE(*cmd))
+				cmd++;
+			for (word = cmd; *cmd && !IS_WHITESPACE(*cmd); cmd++)
+				;
+			if (cmd > word)
+				trie_insert(&src->trie, word, cmd - word);
+		}
+	}
+	src->seen = i;
+}
+
+// Whether the word at end, in the stage starting at p, is a program: the
+// first word, or the one after start, background, time or repeat [-j N] <n>
+static int compl_is_cmd(const char *p, const char *end)
+{
+	const char *word;
+	size_t len;
+	int skip = 0; // Words left before the program
+
+	while (1) {
+		while (p < end && IS_WHITESPACE(*p))
+			p++;
+		if (p == end)
+			return skip == 0;
+		for (word = p; p < end && !IS_WHITESPACE(*p); p++)
+			;
+		len = p - word;
+
+		if (skip > 0) {
+			// After repeat's -j come its number and then the count
+			if (skip == 1 && len == 2 && memcmp(word, "-j", 2) == 0)
+				skip = 3;
+			skip--;
+		}
+		else if ((len == 5 && memcmp(word, "start", 5) == 0)
+			|| (len == 10 && memcmp(word, "background", 10) == 0)
+			|| (len == 4 && memcmp(word, "time", 4) == 0)) {
+			continue;
+		}
+		else if (len == 6 && memcmp(word, "repeat", 6) == 0) {
+			skip = 1;
+		}
+		else {
+			return 0;
+		}
+	}
+}
+
+// Works out what the word ending at pos is and where its candidates are
+static void compl_context(ComplContext *ctx, const char *line, size_t pos)
+{
+	const char *p, *slash;
+
+	memset(ctx, 0, sizeof(*ctx));
+	for (p = line + pos; p > line && !IS_WHITESPACE(p[-1]) && p[-1] != '|'; p--)
+		;
+	ctx->word = p;
+	ctx->len = line + pos - p;
+
+	while (p > line && p[-1] != '|')
+		p--;
+	ctx->is_cmd = compl_is_cmd(p, ctx->word);
+
+	ctx->base = ctx->word;
+	if (ctx->len > 0 && ctx->word[0] == '$') {
+		ctx->base = ctx->word + 1;
+		// ${NAME
+		ctx->base += ctx->len > 1 && ctx->base[0] == '{';
+	}
+	else if ((slash = (const char *) memrchr(ctx->word, '/', ctx->len)) != NULL) {
+		ctx->base = slash + 1;
+		ctx->dir = ctx->word == slash ? strdup("/") : strndup(ctx->word, slash - ctx->word);
+	}
+	else if (!ctx->is_cmd) {
+		ctx->dir = strdup(".");
+	}
+}
+
+static int compl_keep(void *arg, const char *word, size_t len)
+{
+	TabCompl *compl = (TabCompl *) arg;
+
+	if (compl->num_kept >= COMPL_MAX_MATCHES)
+		return 1;
+	sb_append(&compl->matches, word, len);
+	sb_append(&compl->matches, "", 1);
+	compl->num_kept++;
+	return 0;
+}
+
+// Adds src's words starting with base to the matches
+static void compl_query(TabCompl *compl, ComplSrc *src, const char *base, size_t len)
+{
+	StrBuf word = {0};
+	StrBuf common = {0};
+	size_t n;
+	int node;
+
+	if ((node = trie_find(&src->trie, base, len)) < 0)
+		return;
+
+	trie_common(&src->trie, node, &common);
+	if (compl->num_matches == 0) {
+		compl->common.len = 0;
+		sb_append(&compl->common, common.data, common.len);
+	}
+	else {
+		// Only what this source has in common with the others
+		for (n = 0; n < compl->common.len && n < common.len
+			&& compl->common.data[n] == common.data[n]; n++)
+			;
+		compl->common.len = n;
+	}
+	compl->num_matches += src->trie.nodes[node].words;
+
+	sb_append(&word, base, len);
+	trie_walk(&src->trie, node, &word, compl_keep, compl);
+	sb_free(&word);
+	sb_free(&common);
+}
+
+static int compl_cmp(const void *a, const void *b)
+{
+	return strcmp(*(const char **) a, *(const char **) b);
+}
+
+// Sorts the kept matches and drops duplicates (a builtin that's also a
+// program, say)
+static void compl_unique(TabCompl *compl)
+{
+	char **words = (char **) malloc(sizeof(char *) * (compl->num_kept + 1));
+	StrBuf sorted = {0};
+	size_t off = 0;
+	int n = 0;
+
+	for (int i = 0; i < compl->num_kept; i++) {
+		words[i] = compl->matches.data + off;
+		off += strlen(words[i]) + 1;
+	}
+	qsort(words, compl->num_kept, sizeof(char *), compl_cmp);
+	for (int i = 0; i < compl->num_kept; i++) {
+		if (i > 0 && strcmp(words[i], words[i - 1]) == 0)
+			continue;
+		sb_append(&sorted, words[i], strlen(words[i]) + 1);
+		n++;
+	}
+
+	// Every duplicate was kept, so the total drops by as many
+	compl->num_matches -= compl->num_kept - n;
+	compl->num_kept = n;
+	free(words);
+	sb_free(&compl->matches);
+	compl->matches = sorted;
+}
+
+// Completes the word that ends at pos in line from the sources that fit
+// where it is: builtins and PATH for a command, directory entries for paths
+// and arguments, variables after a $ and, failing all that, words from the
+// history. Fills shelly->compl and ctx (free ctx->dir) and returns how many
+// candidates there are.
+int tab_complete(Shell *shelly, const char *line, size_t pos, ComplContext *ctx)
+{
+	TabCompl *compl = &shelly->compl;
+	size_t base_len;
+
+	compl_context(ctx, line, pos);
+	base_len = ctx->word + ctx->len - ctx->base;
+	compl->matches.len = compl->common.len = 0;
+	compl->num_matches = compl->num_kept = 0;
+
+	if (ctx->base != ctx->word && ctx->word[0] == '$') {
+		compl->vars.refresh = refresh_vars;
+		refresh_vars(shelly, &compl->vars, NULL);
+		compl_query(compl, &compl->vars, ctx->base, base_len);
+	}
+	else if (ctx->dir) {
+		refresh_files(shelly, &compl->files, ctx->dir);
+		compl_query(compl, &compl->files, ctx->base, base_len);
+	}
+	else {
+		refresh_builtins(shelly, &compl->builtins, NULL);
+		refresh_path(shelly, &compl->path, NULL);
+		compl_query(compl, &compl->builtins, ctx->base, base_len);
+		compl_query(compl, &compl->path, ctx->base, base_len);
+	}
+
+	if (compl->num_matches == 0 && ctx->base == ctx->word && ctx->len > 0) {
+		refresh_hist(shelly, &compl->hist, NULL);
+		compl_query(compl, &compl->hist, ctx->base, base_len);
+	}
+
+	if (compl->num_kept > 1)
+		compl_unique(compl);
+	return compl->num_matches;
+}
+
+void compl_free(TabCompl *compl)
+{
+	compl_src_free(&compl->builtins);
+	compl_src_free(&compl->path);
+	compl_src_free(&compl->files);
+	compl_src_free(&compl->vars);
+	compl_src_free(&compl->hist);
+	sb_free(&compl->matches);
+	sb_free(&compl->common);
+}
+
+
+// Columns text takes up: UTF-8 continuation bytes and escape sequences (as
+// in a coloured prompt) don't count
+static size_t text_cols(const char *text, size_t len)
+{
+	size_t cols = 0;
+
+	for (size_t i = 0; i < len; i++) {
+		if (text[i] == '\x1b' && i + 1 < len && text[i + 1] == '[') {
+			for (i += 2; i < len && !isalpha((unsigned char) text[i]); i++)
+				;
+		}
+		else if (((unsigned char) text[i] & 0xc0) != 0x80) {
+			cols++;
+		}
+	}
+	return cols;
+}
+
+// Offsets of the characters before and after pos
+static size_t utf8_prev(const char *text, size_t pos)
+{
+	while (pos > 0 && ((unsigned char) text[--pos] & 0xc0) == 0x80)
+		;
+	return pos;
+}
+
+static size_t utf8_next(const char *text, size_t len, size_t pos)
+{
+	if (pos >= len)
+		return len;
+	// Never looks at text[len], the line isn't always terminated
+	while (pos + 1 < len && ((unsigned char) text[pos + 1] & 0xc0) == 0x80)
+		pos++;
+	return pos + 1;
+}
+
+// Redraws the prompt and line, scrolled sideways so the cursor is on screen
+static void edit_refresh(LineEdit *ed)
+{
+	struct winsize ws;
+	const char *text = ed->line->data;
+	size_t len = ed->line->len;
+	size_t cols = 80, avail, cursor, start = 0, end;
+	char move[32];
+
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0)
+		cols = ws.ws_col;
+	avail = cols > ed->prompt_cols + 1 ? cols - ed->prompt_cols : 1;
+
+	cursor = text_cols(text, ed->pos);
+	while (cursor >= avail) {
+		cursor -= text_cols(text + start, utf8_next(text, len, start) - start);
+		start = utf8_next(text, len, start);
+	}
+	for (end = start; end < len && text_cols(text + start, end - start) < avail; )
+		end = utf8_next(text, len, end);
+	if (text_cols(text + start, end - start) > avail)
+		end = utf8_prev(text, end);
+
+	ed->out.len = 0;
+	sb_append(&ed->out, "\r", 1);
+	sb_append(&ed->out, ed->prompt, strlen(ed->prompt));
+	sb_append(&ed->out, text + start, end - start);
+	sb_append(&ed->out, "\x1b[0K\r", 5);
+	if (ed->prompt_cols + cursor > 0) {
+		sprintf(move, "\x1b[%zuC", ed->prompt_cols + cursor);
+		sb_append(&ed->out, move, strlen(move));
+	}
+	if (write(STDOUT_FILENO, ed->out.data, ed->out.len) < 0)
+		return;
+}
+
+static void edit_insert(LineEdit *ed, const char *text, size_t len)
+{
+	StrBuf *line = ed->line;
+
+	sb_reserve(line, len);
+	memmove(line->data + ed->pos + len, line->data + ed->pos, line->len - ed->pos);
+	memcpy(line->data + ed->pos, text, len);
+	line->len += len;
+	ed->pos += len;
+}
+
+// Removes bytes [from, to) of the line and puts the cursor at from
+static void edit_delete(LineEdit *ed, size_t from, size_t to)
+{
+	StrBuf *line = ed->line;
+
+	if (from == to)
+		return;
+	memmove(line->data + from, line->data + to, line->len - to);
+	line->len -= to - from;
+	ed->pos = from;
+}
+
+// Moves delta entries through the history, past the newest entry is the line
+// that was being typed
+static void edit_history(Shell *shelly, LineEdit *ed, int delta)
+{
+	CmdHist *hist = &shelly->hist;
+	const char *text;
+	int cur, idx;
+
+	load_hist(shelly);
+	cur = ed->hist_idx < 0 ? hist->len : ed->hist_idx;
+	idx = cur + delta;
+	if (idx < 0 || idx > hist->len)
+		return;
+
+	if (ed->hist_idx < 0)
+		ed->typed = strndup(ed->line->data ? ed->line->data : "", ed->line->len);
+	text = idx == hist->len ? ed->typed : hist_get(hist, idx);
+	ed->line->len = 0;
+	sb_append(ed->line, text, strlen(text));
+	ed->pos = ed->line->len;
+	ed->hist_idx = idx;
+	if (idx == hist->len) {
+		free(ed->typed);
+		ed->typed = NULL;
+		ed->hist_idx = -1;
+	}
+}
+
+// Next byte from the terminal. Redraws the line if a background job's notice
+// was printed over it while waiting.
+static int edit_getc(Shell *shelly, LineEdit *ed)
+{
+	InputSrc *in = shelly->input;
+	long finished = shelly->jobs.num_finished;
+
+	while (in->pos == in->len && shelly->is_running) {
+		if (wait_events(shelly, -1))
+			break;
+		if (shelly->jobs.num_finished != finished) {
+			finished = shelly->jobs.num_finished;
+			edit_refresh(ed);
+		}
+	}
+	return shell_getc(shelly);
+}
+
+// Prints the matches of the last completion in columns under the line
+static void edit_list_matches(TabCompl *compl, LineEdit *ed)
+{
+	struct winsize ws;
+	size_t cols = 80, width = 0, len, off;
+	int per_row, n;
+	char more[64];
+
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0)
+		cols = ws.ws_col;
+	for (off = 0; off < compl->matches.len; off += len + 1) {
+		len = strlen(compl->matches.data + off);
+		if (text_cols(compl->matches.data + off, len) > width)
+			width = text_cols(compl->matches.data + off, len);
+	}
+	width += 2;
+	per_row = width < cols ? cols / width : 1;
+
+	ed->out.len = 0;
+	sb_append(&ed->out, "\r\n", 2);
+	for (off = 0, n = 0; off < compl->matches.len; off += len + 1, n++) {
+		len = strlen(compl->matches.data + off);
+		if (n > 0 && n % per_row == 0)
+			sb_append(&ed->out, "\r\n", 2);
+		sb_append(&ed->out, compl->matches.data + off, len);
+		if ((n + 1) % per_row != 0)
+			for (size_t pad = text_cols(compl->matches.data + off, len); pad < width; pad++)
+				sb_append(&ed->out, " ", 1);
+	}
+	sb_append(&ed->out, "\r\n", 2);
+	if (compl->num_matches > compl->num_kept) {
+		snprintf(more, sizeof(more), "(and %d more)\r\n", compl->num_matches - compl->num_kept);
+		sb_append(&ed->out, more, strlen(more));
+	}
+	if (write(STDOUT_FILENO, ed->out.data, ed->out.len) < 0)
+		return;
+}
+
+// Tab: fills in as much of the word before the cursor as all its
+// completions share, finishing it with a space when there's only one. A
+// second Tab in a row lists them.
+static void edit_complete(Shell *shelly, LineEdit *ed, int list)
+{
+	TabCompl *compl = &shelly->compl;
+	ComplContext ctx;
+	int n;
+
+	n = tab_complete(shelly, ed->line->data ? ed->line->data : "", ed->pos, &ctx);
+	free(ctx.dir);
+	if (n == 0)
+		return;
+
+	edit_insert(ed, compl->common.data, compl->common.len);
+	if (n == 1) {
+		if (compl->common.len == 0 || compl->common.data[compl->common.len - 1] != '/')
+			edit_insert(ed, " ", 1);
+	}
+	else if (list && compl->common.len == 0) {
+		edit_list_matches(compl, ed);
+	}
+}
+
+// ^R: searches the history as a pattern is typed, newest match first, and
+// another ^R goes to the next older one. Enter runs the match, ^G or ^C go
+// back to the line as it was and any other key keeps the match to edit (and
+// then does what it normally does). Returns 1 to run the line, -1 at the end
+// of input.
+static int edit_search(Shell *shelly, LineEdit *ed)
+{
+	InputSrc *in = shelly->input;
+	StrBuf *line = ed->line;
+	StrBuf pat = {0}, shown = {0}, prompt = {0};
+	const char *cmd, *at, *saved_prompt = ed->prompt;
+	size_t pos = ed->pos, saved_cols = ed->prompt_cols;
+	char ch;
+	int match = shelly->hist.len, found, c, failed = 0, ret = 0;
+
+	sb_append(&shown, line->data, line->len);
+	ed->line = &shown;
+	while (1) {
+		prompt.len = 0;
+		sb_append(&prompt, failed ? "(failed reverse-i-search)`" : "(reverse-i-search)`",
+			failed ? 26 : 19);
+		sb_append(&prompt, pat.data, pat.len);
+		sb_append(&prompt, "': ", 4);
+		ed->prompt = prompt.data;
+		ed->prompt_cols = text_cols(prompt.data, prompt.len - 1);
+		edit_refresh(ed);
+
+		if ((c = edit_getc(shelly, ed)) == EOF) {
+			ret = -1;
+			break;
+		}
+
+		if (c == 18) { // ^R
+			if (pat.len == 0)
+				continue;
+		}
+		else if (c == 127 || c == 8) {
+			if (pat.len == 0)
+				continue;
+			pat.len = utf8_prev(pat.data, pat.len);
+			match = shelly->hist.len;
+		}
+		else if (c >= ' ') {
+			ch = c;
+			sb_append(&pat, &ch, 1);
+			// The current match may still do
+			match = match < shelly->hist.len ? match + 1 : match;
+		}
+		else {
+			break;
+		}
+
+		if (pat.len == 0) {
+			failed = 0;
+			continue;
+		}
+		if ((failed = hist_search(shelly, pat.data, pat.len, match, &found, 1) == 0))
+			continue;
+		match = found;
+		cmd = hist_get(&shelly->hist, match);
+		shown.len = 0;
+		sb_append(&shown, cmd, strlen(cmd));
+		at = (const char *) memmem(cmd, shown.len, pat.data, pat.len);
+		ed->pos = at - cmd;
+	}
+
+	ed->line = line;
+	ed->prompt = saved_prompt;
+	ed->prompt_cols = saved_cols;
+	if (c == 7 || c == 3 || ret < 0) { // ^G, ^C
+		ed->pos = pos;
+	}
+	else {
+		line->len = 0;
+		sb_append(line, shown.data, shown.len);
+		free(ed->typed);
+		ed->typed = NULL;
+		ed->hist_idx = -1;
+		if (c == '\r' || c == '\n')
+			ret = 1;
+		else
+			in->pos--; // Handled by edit_line
+	}
+	sb_free(&pat);
+	sb_free(&shown);
+	sb_free(&prompt);
+	return ret;
+}
+
+// Reads a line into shelly->line with the terminal in raw mode: arrows, Home,
+// End and the usual emacs keys move around, Up and Down go through the
+// history, ^R searches it and Tab completes. Typed or pasted text is taken a
+// run at a time straight from the input buffer. Returns -1 at the end of input
+// (^D on an empty line).
+int edit_line(Shell *shelly, const char *prompt)
+{
+	InputSrc *in = shelly->input;
+	struct termios raw;
+	LineEdit ed;
+	size_t run, p;
+	int c, ret = 0, tabs = 0;
+
+	memset(&ed, 0, sizeof(ed));
+	ed.line = &shelly->line;
+	ed.prompt = prompt;
+	ed.prompt_cols = text_cols(prompt, strlen(prompt));
+	ed.hist_idx = -1;
+
+	raw = shell_tmodes;
+	raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+	raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+	raw.c_cc[VMIN] = 1;
+	raw.c_cc[VTIME] = 0;
+	tcsetattr(shell_terminal, TCSANOW, &raw);
+
+	fflush(stdout);
+	edit_refresh(&ed);
+	while (1) {
+		if ((c = edit_getc(shelly, &ed)) == EOF) {
+			ret = -1;
+			break;
+		}
+		tabs = c == '\t' ? tabs + 1 : 0;
+
+		if (c >= ' ' && c != 127) {
+			// The rest of a run of text (a paste, say) is already buffered
+			for (run = in->pos - 1; in->pos < in->len; in->pos++) {
+				c = (unsigned char) in->buf[in->pos];
+				if (c < ' ' || c == 127)
+					break;
+			}
+			edit_insert(&ed, in->buf + run, in->pos - run);
+		}
+		else if (c == '\r' || c == '\n') {
+			break;
+		}
+		else if (c == '\t') {
+			edit_complete(shelly, &ed, tabs > 1);
+		}
+		else if (c == 127 || c == 8) { // Backspace
+			if (ed.pos > 0)
+				edit_delete(&ed, utf8_prev(ed.line->data, ed.pos), ed.pos);
+		}
+		else if (c == 4) { // ^D
+			if (ed.line->len == 0) {
+				ret = -1;
+				break;
+			}
+			if (ed.pos < ed.line->len)
+				edit_delete(&ed, ed.pos, utf8_next(ed.line->data, ed.line->len, ed.pos));
+		}
+		else if (c == 3) { // ^C drops the line
+			ed.line->len = ed.pos = 0;
+			if (write(STDOUT_FILENO, "^C\n", 3) < 0)
+				break;
+			free(ed.typed);
+			ed.typed = NULL;
+			ed.hist_idx = -1;
+		}
+		else if (c == 1) { // ^A
+			ed.pos = 0;
+		}
+		else if (c == 5) { // ^E
+			ed.pos = ed.line->len;
+		}
+		else if (c == 2) { // ^B
+			ed.pos = utf8_prev(ed.line->data, ed.pos);
+		}
+		else if (c == 6) { // ^F
+			ed.pos = utf8_next(ed.line->data, ed.line->len, ed.pos);
+		}
+		else if (c == 11) { // ^K
+			ed.line->len = ed.pos;
+		}
+		else if (c == 21) { // ^U
+			edit_delete(&ed, 0, ed.pos);
+		}
+		else if (c == 23) { // ^W
+			for (p = ed.pos; p > 0 && ed.line->data[p - 1] == ' '; p--)
+				;
+			for (; p > 0 && ed.line->data[p - 1] != ' '; p--)
+				;
+			edit_delete(&ed, p, ed.pos);
+		}
+		else if (c == 12) { // ^L
+			if (write(STDOUT_FILENO, "\x1b[H\x1b[2J", 7) < 0)
+				break;
+		}
+		else if (c == 16) { // ^P
+			edit_history(shelly, &ed, -1);
+		}
+		else if (c == 14) { // ^N
+			edit_history(shelly, &ed, 1);
+		}
+		else if (c == 18) { // ^R
+			if ((c = edit_search(shelly, &ed)) != 0) {
+				ret = c < 0 ? -1 : 0;
+				break;
+			}
+		}
+		else if (c == 27) {
+			// Escape sequences: ESC [ A, ESC [ 3 ~, ESC O H and so on
+			if ((c = edit_getc(shelly, &ed)) != '[' && c != 'O')
+				continue;
+			c = edit_getc(shelly, &ed);
+			if (isdigit(c)) {
+				int num = c - '0';
+				while (isdigit(c = edit_getc(shelly, &ed)))
+					;
+				if (c != '~')
+					continue;
+				c = num == 1 || num == 7 ? 'H' : num == 4 || num == 8 ? 'F' : num == 3 ? 'X' : 0;
+			}
+
+			if (c == 'A')
+				edit_history(shelly, &ed, -1);
+			else if (c == 'B')
+				edit_history(shelly, &ed, 1);
+			else if (c == 'C')
+				ed.pos = utf8_next(ed.line->data, ed.line->len, ed.pos);
+			else if (c == 'D')
+				ed.pos = utf8_prev(ed.line->data, ed.pos);
+			else if (c == 'H')
+				ed.pos = 0;
+			else if (c == 'F')
+				ed.pos = ed.line->len;
+			else if (c == 'X' && ed.pos < ed.line->len)
+				edit_delete(&ed, ed.pos, utf8_next(ed.line->data, ed.line->len, ed.pos));
+		}
+
+		// Only once the buffered input is used up, so a paste redraws once
+		if (in->pos == in->len)
+			edit_refresh(&ed);
+	}
+
+	edit_refresh(&ed);
+	if (write(STDOUT_FILENO, "\n", 1) < 0)
+		ret = -1;
+	tcsetattr(shell_terminal, TCSANOW, &shell_tmodes);
+	free(ed.typed);
+	sb_free(&ed.out);
+	return ret;
+}
+
+// Function to take input
+// Reads the next line of the current input and points cmd at it with
+// variables expanded, valid until the next call. Returns 0 for a command, 1
+// when there's nothing to run and -1 at the end of the input.
+int take_input(Shell* shelly, char **cmd)
+{
+	InputSrc *in = shelly->input;
+	int interactive = shell_is_interactive && in == &shelly->main_input;
+	StrBuf *line = &shelly->line;
+	size_t n;
+	char *nl, *p;
+
+	// Report background jobs that finished while a command ran
+	if (shelly->jobs.num_running > 0)
+		wait_events(shelly, 0);
+	line->len = 0;
+	if (interactive) {
+		if (edit_line(shelly, prompt_render(shelly)) < 0)
+			return -1;
+	}
+	else {
+		// A chunk at a time up to the newline, not a character at a time
+		while (1) {
+			if (in->pos == in->len && fill_input(shelly) == 0) {
+				// A last line without a newline still runs
+				if (line->len == 0)
+					return -1;
+				break;
+			}
+
+			n = in->len - in->pos;
+			nl = (char *) memchr(in->buf + in->pos, '\n', n);
+			if (nl)
+				n = nl - (in->buf + in->pos);
+			sb_append(line, in->buf + in->pos, n);
+			in->pos += n;
+			if (nl) {
+				in->pos++;
+				break;
+			}
+		}
+	}
+	sb_append(line, "", 1);
+
+	// Blank lines and comments (like a #! line) don't run
+	for (p = line->data; IS_WHITESPACE(*p); p++)
+		;
+	if (*p == '\0' || *p == '#')
+		return 1;
+
+	// Expansions can make it any length
+	shelly->expanded.len = 0;
+	expand_vars(&shelly->expanded, line->data, line->len - 1);
+	sb_append(&shelly->expanded, "", 1);
+	if (interactive)
+		add_to_hist(shelly, line->data);
+	*cmd = shelly->expanded.data;
+	return 0;
+}
+
+// Copies argv with REPEAT_INDEX_VAR replaced by index, or returns argv as is
+// when it isn't used
+static char **subst_index(Arena *arena, char **argv, const char *index)
+{
+	size_t var_len = strlen(REPEAT_INDEX_VAR);
+	char **copy;
+	char *at, *from;
+	StrBuf buf = {0};
+	int n, found = 0;
+
+	for (n = 0; argv[n]; n++) {
+		if (strstr(argv[n], REPEAT_INDEX_VAR))
+			found = 1;
+	}
+	if (!found)
+		return argv;
+
+	copy = (char **) arena_alloc(arena, sizeof(char *) * (n + 1));
+	for (int i = 0; i < n; i++) {
+		buf.len = 0;
+		for (from = argv[i]; (at = strstr(from, REPEAT_INDEX_VAR)); from = at + var_len) {
+			sb_append(&buf, from, at - from);
+			// $IN is some other variable
+			if (isalnum(at[var_len]) || at[var_len] == '_')
+				sb_append(&buf, at, var_len);
+			else
+				sb_append(&buf, index, strlen(index));
+		}
+		sb_append(&buf, from, strlen(from) + 1);
+
+		copy[i] = (char *) arena_alloc(arena, buf.len);
+		memcpy(copy[i], buf.data, buf.len);
+	}
+	copy[n] = NULL;
+
+	sb_free(&buf);
+	return copy;
+}
+
+// Starts iteration index of a repeat, see launch_pipeline(). Its command line
+// is substituted into arena, and what it ran is put in cmd unless that's NULL.
+static int repeat_launch(Shell *shell, Arena *arena, char **argv, long index,
+	int pgid, int infile, int outfile, int errfile, pid_t **pids, char **cmd)
+{
+	char ***stages = pipeline.stages;
+	char num[24];
+	int num_pids;
+
+	snprintf(num, sizeof(num), "%ld", index);
+	if (pipeline.num_stages > 0) {
+		pipeline.stages = (char ***) arena_alloc(arena,
+			sizeof(char **) * pipeline.num_stages);
+		for (int i = 0; i < pipeline.num_stages; i++)
+			pipeline.stages[i] = subst_index(arena, stages[i], num);
+	}
+
+	argv = subst_index(arena, argv, num);
+	num_pids = launch_pipeline(shell, argv,
+		pgid, infile, outfile, errfile, pids);
+	if (cmd)
+		*cmd = job_cmdline(argv, pipeline.stages, pipeline.num_stages);
+
+	pipeline.stages = stages;
+	return num_pids;
+}
+
+// repeat -j: keeps at most jobs iterations running and waits for all of them.
+// Background jobs that finish meanwhile are reaped here too. Memory doesn't
+// grow with count: each slot's pids are allocated once and the substituted
+// command lines go in an arena that's reset after every launch.
+static void repeat_throttled(Shell *shell, char **argv, long count, int jobs,
+	int infile, int outfile, int errfile)
+{
+	int num_stages = pipeline.num_stages + 1;
+	RepeatSlot *slots = (RepeatSlot *) arena_alloc(&shell->cmd_arena, sizeof(RepeatSlot) * jobs);
+	pid_t *slot_pids = (pid_t *) arena_alloc(&shell->cmd_arena, sizeof(pid_t) * jobs * num_stages);
+	int *free_slots = (int *) arena_alloc(&shell->cmd_arena, sizeof(int) * jobs);
+	int *busy = (int *) arena_alloc(&shell->cmd_arena, sizeof(int) * jobs);
+	int num_free = jobs, running = 0, stop = 0;
+	long started = 0, done = 0, failed = 0;
+	int64_t start_ns = now_ns();
+	Arena scratch = {0};
+	RepeatSlot *slot;
+	Job *job;
+	siginfo_t info;
+	double secs;
+	pid_t pid;
+	int status, k;
+
+	memset(slots, 0, sizeof(RepeatSlot) * jobs);
+	for (int i = 0; i < jobs; i++) {
+		free_slots[i] = jobs - 1 - i;
+		slots[i].pids = slot_pids + i * num_stages;
+	}
+
+	while (1) {
+		while (!stop && started < count && num_free > 0) {
+			slot = &slots[free_slots[--num_free]];
+			started++;
+			// In our process group, so ^C reaches them
+			slot->num_pids = repeat_launch(shell, &scratch, argv, started, shell_pgid,
+				infile, outfile, errfile, &slot->pids, NULL);
+			arena_reset(&scratch);
+			slot->left = slot->num_pids;
+			slot->failed = 0;
+
+			if (slot->num_pids <= pipeline.num_stages) {
+				// Out of processes or the program is gone, don't keep trying
+				slot->failed = 1;
+				stop = 1;
+			}
+			if (slot->left > 0) {
+				slot->busy_at = running;
+				busy[running++] = slot - slots;
+			}
+			else {
+				done++;
+				failed++;
+				free_slots[num_free++] = slot - slots;
+			}
+		}
+
+		if (running == 0)
+			break;
+
+		// Only peek, it might be a background job
+		info.si_pid = 0;
+		if (waitid(P_ALL, 0, &info, WEXITED | WNOWAIT) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		pid = info.si_pid;
+
+		slot = NULL;
+		for (int i = 0; i < running && !slot; i++) {
+			for (k = 0; k < slots[busy[i]].num_pids; k++) {
+				if (slots[busy[i]].pids[k] == pid) {
+					slot = &slots[busy[i]];
+					break;
+				}
+			}
+		}
+
+		if (!slot) {
+			if ((job = find_job(shell, pid, &k)) != NULL)
+				reap_job(shell, job, k);
+			else
+				waitpid(pid, &status, 0);
+			continue;
+		}
+
+		waitpid(pid, &status, 0);
+		// The pid can be reused now, it mustn't match this slot again
+		slot->pids[k] = 0;
+
+		if (k == pipeline.num_stages && exit_code(status) != 0)
+			slot->failed = 1;
+		// ^C goes to all of them, stop starting new ones
+		if (WIFSIGNALED(status) && WTERMSIG(status) == SIGINT)
+			stop = 1;
+
+		if (--slot->left == 0) {
+			// The last running slot takes its place in the list
+			busy[slot->busy_at] = busy[--running];
+			slots[busy[slot->busy_at]].busy_at = slot->busy_at;
+			done++;
+			if (slot->failed)
+				failed++;
+			free_slots[num_free++] = slot - slots;
+		}
+	}
+
+	arena_free(&scratch);
+	secs = (now_ns() - start_ns) / 1e9;
+	printf("repeat: %ld runs in %.3fs (%.1f runs/s), %ld failed\n",
+		done, secs, secs > 0 ? done / secs : 0.0, failed);
+	shell->last_status = failed > 0;
+}
+
+int repeat(Shell *shell, CmdArgv argv, int argc)
+{
+	int jobs = 0;
+
+	if (argc > 2 && strcmp(argv[1], "-j") == 0) {
+		jobs = strtol(argv[2], NULL, 10);
+		if (jobs <= 0)
+			return 1;
+		argv += 2;
+		argc -= 2;
+	}
+
+	if (argc < 3)
+		return 1;
+
+	long repeat_count = strtol(argv[1], NULL, 10);
+  int dev_null = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	int infile = dev_null;
+	int outfile = shell->outfile;
+	int errfile = shell->errfile;
+	pid_t *pids;
+	char *cmd;
+	int num_pids;
+	long i;
+
+	if (jobs > 0) {
+		repeat_throttled(shell, argv + 2, repeat_count, jobs, infile, outfile, errfile);
+		close(dev_null);
+		return 0;
+	}
+
+	for (i = 0; i < repeat_count; i++) {
+	 if (mtx_lock(&shell->bg_mtx) != thrd_success) {
+			printf("Unable to get lock on bg job list!\n");
+			exit(1);
+		}
+
+		// printf("outfile: %d\n", outfile);
+		pids = NULL;
+		num_pids = repeat_launch(shell, &shell->cmd_arena,
+			argv + 2, i + 1, 0, infile, outfile, errfile, &pids, &cmd
+		);
+
+		for (int j = 0; j < num_pids; j++)
+			printf("pid: %d\n", pids[j]);
+		if (num_pids > 0)
+			add_job(shell, pids, num_pids, cmd);
+		else
+			free(cmd);
+		mtx_unlock(&shell->bg_mtx);
+
+		if (num_pids <= pipeline.num_stages)
+			break;
+	}
+
+	close(dev_null);
+	return 0;
+}
+
+int repeat_help(Shell *shell, CmdArgv argv, int argc)
+{
+	printf("repeat [-j N] <n> <command>  repeat <command> <n> times, {I is the run number\n");
+	printf("                             -j runs at most N at once and waits for all\n");
+	return 0;
+}
+
+int start(Shell *shell, CmdArgv argv, int argc)
+{
+	if (argc < 2)
+		return 1;
+
+	int infile = shell->infile;
+	int outfile = shell->outfile;
+	int errfile = shell->errfile;
+
+	pid_t *pids = NULL;
+	int64_t start_ns = now_ns();
+	int num_pids = launch_pipeline(
+		shell, argv + 1, shell_pgid, 
+		infile, outfile, errfile, &pids
+	);
+
+	shell->last_status = wait_pipeline(
+		pids, num_pids, pipeline.num_stages + 1, &shell->fg_usage
+	);
+	shell->fg_wall_ns += now_ns() - start_ns;
+
+	return 0;
+}
+
+static void print_usage(int64_t wall_ns, const JobUsage *usage)
+{
+	printf("real    %.3fs\n", wall_ns / 1e9);
+	printf("user    %.3fs\n", usage->user_us / 1e6);
+	printf("sys     %.3fs\n", usage->sys_us / 1e6);
+	printf("maxrss  %ld KB\n", usage->max_rss_kb);
+	printf("ctxsw   %ld\n", usage->ctx_switches);
+}
+
+// Like start, then prints what the command used. Without a command prints
+// the totals for every foreground command so far.
+int time_cmd(Shell *shell, CmdArgv argv, int argc)
+{
+	JobUsage before = shell->fg_usage;
+	JobUsage usage;
+	int64_t wall_ns = shell->fg_wall_ns;
+
+	if (argc < 2) {
+		print_usage(shell->fg_wall_ns, &shell->fg_usage);
+		return 0;
+	}
+
+	// `time start ls` is the same as `time ls`
+	if (argc > 2 && strcmp(argv[1], "start") == 0) {
+		argv++;
+		argc--;
+	}
+
+	// Only count this command, max_rss_kb can't be subtracted
+	shell->fg_usage.max_rss_kb = 0;
+	start(shell, argv, argc);
+
+	usage.user_us = shell->fg_usage.user_us - before.user_us;
+	usage.sys_us = shell->fg_usage.sys_us - before.sys_us;
+	usage.max_rss_kb = shell->fg_usage.max_rss_kb;
+	usage.ctx_switches = shell->fg_usage.ctx_switches - before.ctx_switches;
+	if (before.max_rss_kb > shell->fg_usage.max_rss_kb)
+		shell->fg_usage.max_rss_kb = before.max_rss_kb;
+
+	printf("\n");
+	print_usage(shell->fg_wall_ns - wall_ns, &usage);
+	return 0;
+}
+
+int time_cmd_help(Shell *shell, CmdArgv argv, int argc)
+{
+	printf("time [command]               run command and print the time and memory it used,\n");
+	printf("                             or the totals for every foreground command\n");
+	return 0;
+}
+
+int start_help(Shell *shell, CmdArgv argv, int argc)
+{
+  printf("start <program> [param]      start a program\n");	
+	return 0;
+}
+
+
+int background(Shell *shell, CmdArgv argv, int argc)
+{
+	if (argc < 2)
+		return 1;
+
+  int dev_null = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	pid_t *pids = NULL;
+	int num_pids;
+	int infile = dev_null;
+	int outfile = shell->outfile;
+	int errfile = shell->errfile;
 
  if (mtx_lock(&shell->bg_mtx) != thrd_success) {
 		printf("Unable to get lock on bg job list!\n");
 		exit(1);
 	}
 
-	// printf("outfile: %d\n", outfile);
-	pid = launch_process(
-		process_args, argc, shell_pgid, infile, outfile, errfile, 0
+	// A process group of its own, so signals reach everything it starts and
+	// ^C doesn't
+	num_pids = launch_pipeline(
+		shell, argv + 1, 0, infile, outfile, errfile, &pids
 	);
 
-	add_bgpid(shell, pid);
+	for (int i = 0; i < num_pids; i++)
+		printf("pid: %d\n", pids[i]);
+	if (num_pids > 0)
+		add_job(shell, pids, num_pids,
+			job_cmdline(argv + 1, pipeline.stages, pipeline.num_stages));
 	mtx_unlock(&shell->bg_mtx);
-	printf("pid: %d\n", pid);
 
 	close(dev_null);
-	free(process_args);
 	return 0;
 }
 
@@ -758,167 +4906,597 @@ int background_help(Shell *shell, CmdArgv argv, int argc)
 
 void kill_child(int pid)
 {
-  // Check if the pid exists
-  kill(pid, 0);
-  if (errno == ESRCH) {
-    printf("The process with pid %d does not exist.\n", pid);
-  }
-  else {
-    // No mercy
-    kill(pid, SIGKILL);
-    if (errno == EPERM)
-      printf("Permission denied.\n");
-    else
-      printf("Killed %d\n", pid);
+	Job *job;
+	int stage;
+
+	// No mercy, for the whole job if it's one of ours
+	if ((job = find_job(root_shell, pid, &stage)) != NULL) {
+		if (signal_job(job, SIGKILL) == 0) {
+			printf("Killed [%d]\n", job->id);
+			return;
+		}
+	}
+	else if (signal_pid(pid, SIGKILL) == 0) {
+		printf("Killed %d\n", pid);
+		return;
+	}
+
+	if (errno == ESRCH)
+		printf("The process with pid %d does not exist.\n", pid);
+	else if (errno == EPERM)
+		printf("Permission denied.\n");
+	else
+		printf("Unable to kill %d: %s\n", pid, strerror(errno));
+}
+
+
+// Sends sig to every job, returns how many got it
+static int signal_jobs(Shell *shell, int sig)
+{
+	Job *job;
+	int count = 0;
+
+	for (int i = 0; i < shell->jobs.cap; i++) {
+		job = &shell->jobs.jobs[i];
+		if (job->state != JOB_FREE && signal_job(job, sig) == 0)
+			count++;
+	}
+	return count;
+}
+
+int dalekall(Shell *shell, CmdArgv argv, int argc)
+{
+	int grace_ms = -1, termed, killed;
+	int64_t deadline;
+	int left_ms;
+	char *end;
+	long n;
+
+	if (argc == 3 && strcmp(argv[1], "--grace") == 0) {
+		errno = 0;
+		n = strtol(argv[2], &end, 10);
+		if (errno != 0 || end == argv[2] || *end != '\0' || n < 0 || n > INT32_MAX) {
+			printf("Invalid grace period: %s\n", argv[2]);
+			return 1;
+		}
+		grace_ms = n;
+	}
+	else if (argc != 1) {
+		return 1;
+	}
+
+	mtx_lock(&shell->bg_mtx);
+	// They leave the table once they're reaped
+	if (grace_ms < 0) {
+		printf("Killed %d jobs\n", signal_jobs(shell, SIGKILL));
+		mtx_unlock(&shell->bg_mtx);
+		return 0;
+	}
+
+	// Ask everyone at once, then wait on the pidfds for them to go
+	termed = signal_jobs(shell, SIGTERM);
+	// A stopped job only sees the SIGTERM once it runs again
+	signal_jobs(shell, SIGCONT);
+
+	deadline = now_ns() + grace_ms * 1000000LL;
+	watch_input(shell, 0);
+	while (shell->jobs.num_running > 0 && shell->is_running) {
+		left_ms = (deadline - now_ns() + 999999) / 1000000;
+		if (left_ms <= 0)
+			break;
+		wait_events(shell, left_ms);
+	}
+	watch_input(shell, 1);
+
+	killed = signal_jobs(shell, SIGKILL);
+	printf("%d jobs terminated, %d killed after %d ms\n", termed - killed, killed, grace_ms);
+	mtx_unlock(&shell->bg_mtx);
+
+	return 0;
+}
+
+int dalekall_help(Shell *shell, CmdArgv argv, int argc)
+{
+	printf("dalekall [--grace <ms>]      execute order 66, with --grace jobs get SIGTERM\n");
+	printf("                             and <ms> to exit before SIGKILL\n");
+	return 0;
+}
+
+int dalek(Shell *shell, CmdArgv argv, int argc)
+{
+  if (argc != 2)
+    return 1;
+
+  int pid = strtol(argv[1], NULL, 10);
+	kill_child(pid);
+
+	return 0;
+}
+
+int dalek_help(Shell *shell, CmdArgv argv, int argc)
+{
+  printf("dalek <pid>                  kill the process w/ pid <pid> (its whole job)\n");	
+	return 0;
+}
+
+// Write alpha numberic dirname to dir and returns the ending location in path
+// Returns NULL at the end of the path
+char* get_next_dir(char *dir, char *path)
+{
+  if (*path == '/') {
+    dir[0] = '/';
+    dir[1] = '\0'; 
+    return path + 1;
   }
+
+	while (*path != '/') {
+    putc(*path, stdin);
+		*dir = *path;
+
+		if (*path == '\0')
+			return NULL;
+
+		path++;
+		dir++;
+	}
+
+  *dir = '\0';
+
+	// Move until next non-'/' to supports paths like
+	// /dev///whoops/too//many//slashes
+	while (*path == '/')
+		path++;
+
+	return path;
+}
+
+// Joins path onto base (unless it's absolute) and resolves ".", ".." and
+// repeated slashes, without looking at the filesystem
+static void path_canon(StrBuf *out, const char *base, const char *path)
+{
+	const char *comp, *end;
+
+	out->len = 0;
+	if (path[0] != '/')
+		sb_append(out, base, strlen(base));
+	// The root is kept as "" until the end
+	if (out->len == 1)
+		out->len = 0;
+
+	for (comp = path; *comp; comp = *end ? end + 1 : end) {
+		end = strchrnul(comp, '/');
+		if (end == comp || (end - comp == 1 && comp[0] == '.'))
+			continue;
+		if (end - comp == 2 && comp[0] == '.' && comp[1] == '.') {
+			while (out->len > 0 && out->data[--out->len] != '/')
+				;
+			continue;
+		}
+		sb_append(out, "/", 1);
+		sb_append(out, comp, end - comp);
+	}
+
+	if (out->len == 0)
+		sb_append(out, "/", 1);
+	sb_append(out, "", 1);
+	out->len--;
+}
+
+static DirVisit* dir_db_add(DirDb *db, const char *path)
+{
+	DirVisit *ent;
+
+	if (db->num == db->cap) {
+		db->cap = db->cap ? db->cap * 2 : 64;
+		db->ents = (DirVisit *) realloc(db->ents, sizeof(DirVisit) * db->cap);
+	}
+	ent = db->ents + db->num++;
+	ent->path = strdup(path);
+	ent->rank = ent->added = 0;
+	ent->when = 0;
+	return ent;
+}
+
+static DirVisit* dir_db_find(DirDb *db, const char *path)
+{
+	for (int i = 0; i < db->num; i++) {
+		if (strcmp(db->ents[i].path, path) == 0)
+			return db->ents + i;
+	}
+	return NULL;
+}
+
+// Adds the entries in file to db
+static void dir_db_read(DirDb *db, FILE *file)
+{
+	DirVisit *ent;
+	char *line = NULL, *p, *path;
+	size_t cap = 0;
+	ssize_t len;
+
+	while ((len = getline(&line, &cap, file)) > 0) {
+		if (line[len - 1] == '\n')
+			line[--len] = '\0';
+		if ((p = strchr(line, '\t')) == NULL || (path = strchr(p + 1, '\t')) == NULL
+			|| path[1] != '/')
+			continue;
+
+		ent = dir_db_add(db, path + 1);
+		ent->rank = strtod(line, NULL);
+		ent->when = strtoll(p + 1, NULL, 10);
+	}
+	free(line);
+}
+
+static void dir_db_load(Shell *shelly)
+{
+	DirDb *db = &shelly->dirs;
+	StrBuf filepath = {0};
+	FILE *file;
+
+	if (db->loaded)
+		return;
+	db->loaded = 1;
+
+	expand_vars(&filepath, DIR_DB_FILEPATH, strlen(DIR_DB_FILEPATH));
+	sb_append(&filepath, "", 1);
+	db->filepath = filepath.data;
+	if ((file = fopen(db->filepath, "r")) == NULL)
+		return;
+	dir_db_read(db, file);
+	fclose(file);
+}
+
+// Scales every rank down once they add up to more than DIR_DB_MAX_RANK,
+// forgetting the ones that drop below 1. Called before a visit is counted, so
+// a directory that's just been added is never the one forgotten.
+static void dir_db_age(DirDb *db)
+{
+	double total = 0;
+	int kept = 0;
+
+	for (int i = 0; i < db->num; i++)
+		total += db->ents[i].rank;
+	if (total <= DIR_DB_MAX_RANK)
+		return;
+
+	for (int i = 0; i < db->num; i++) {
+		db->ents[i].rank *= 0.99;
+		if (db->ents[i].rank < 1) {
+			free(db->ents[i].path);
+			continue;
+		}
+		db->ents[kept++] = db->ents[i];
+	}
+	db->num = kept;
+}
+
+// Counts a visit to path, aging every rank once they add up to too much
+static void dir_db_visit(Shell *shelly, const char *path)
+{
+	DirDb *db = &shelly->dirs;
+	DirVisit *ent;
+
+	dir_db_load(shelly);
+	dir_db_age(db);
+	if ((ent = dir_db_find(db, path)) == NULL)
+		ent = dir_db_add(db, path);
+	ent->rank += 1;
+	ent->added += 1;
+	ent->when = time(NULL);
+	db->dirty = 1;
+}
+
+static double dir_frecency(const DirVisit *ent, int64_t now)
+{
+	int64_t age = now - ent->when;
+
+	if (age < 3600)
+		return ent->rank * 4;
+	if (age < 86400)
+		return ent->rank * 2;
+	if (age < 7 * 86400)
+		return ent->rank / 2;
+	return ent->rank / 4;
+}
+
+// Whether path has every word in it, in order, ignoring case
+static int dir_matches(const char *path, CmdArgv words, int num_words)
+{
+	const char *p = path;
+
+	for (int i = 0; i < num_words; i++) {
+		if ((p = strcasestr(p, words[i])) == NULL)
+			return 0;
+		p += strlen(words[i]);
+	}
+	return 1;
+}
+
+// Opens the dirs file and locks it. A shell that saved while we waited has
+// renamed a new file into place, so then it's the new one we want.
+static int dir_db_lock(const char *filepath)
+{
+	struct stat fd_st, path_st;
+	int fd;
+
+	while (1) {
+		if ((fd = open(filepath, O_RDONLY | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR)) < 0)
+			return -1;
+		if (flock(fd, LOCK_EX) < 0) {
+			close(fd);
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (fstat(fd, &fd_st) == 0 && stat(filepath, &path_st) == 0
+			&& fd_st.st_dev == path_st.st_dev && fd_st.st_ino == path_st.st_ino)
+			return fd;
+		close(fd);
+	}
+}
+
+// Merges this shell's visits into the file: under its lock, what's there now
+// is read again, the ranks we gained added and directories we found gone
+// removed. The result goes to a temporary file that's renamed into place, so
+// another shell never reads half of it.
+void dir_db_save(Shell *shelly)
+{
+	DirDb *db = &shelly->dirs, disk;
+	DirVisit *ent, *ours;
+	StrBuf out = {0};
+	char *tmp_path, line[64];
+	int lock_fd, fd, n;
+	FILE *file;
+
+	if (!db->dirty || db->filepath == NULL)
+		return;
+	db->dirty = 0;
+	if ((lock_fd = dir_db_lock(db->filepath)) < 0)
+		return;
+
+	memset(&disk, 0, sizeof(disk));
+	if ((file = fdopen(dup(lock_fd), "r")) != NULL) {
+		dir_db_read(&disk, file);
+		fclose(file);
+	}
+	for (int i = 0; i < db->num_forgotten; i++) {
+		if ((ent = dir_db_find(&disk, db->forgotten[i])) != NULL) {
+			free(ent->path);
+			*ent = disk.ents[--disk.num];
+		}
+	}
+	dir_db_age(&disk);
+	for (int i = 0; i < db->num; i++) {
+		ours = db->ents + i;
+		if (ours->added == 0)
+			continue;
+		if ((ent = dir_db_find(&disk, ours->path)) == NULL)
+			ent = dir_db_add(&disk, ours->path);
+		ent->rank += ours->added;
+		if (ours->when > ent->when)
+			ent->when = ours->when;
+		ours->added = 0;
+	}
+
+	for (int i = 0; i < disk.num; i++) {
+		n = snprintf(line, sizeof(line), "%.3f\t%lld\t", disk.ents[i].rank, (long long) disk.ents[i].when);
+		sb_append(&out, line, n);
+		sb_append(&out, disk.ents[i].path, strlen(disk.ents[i].path));
+		sb_append(&out, "\n", 1);
+	}
+
+	tmp_path = (char *) malloc(strlen(db->filepath) + 8);
+	sprintf(tmp_path, "%s.XXXXXX", db->filepath);
+	if ((fd = mkstemp(tmp_path)) >= 0) {
+		if (write_all(fd, out.data, out.len) < 0 || rename(tmp_path, db->filepath) < 0)
+			unlink(tmp_path);
+		close(fd);
+	}
+	// Only now, so the next shell to lock it sees the new file
+	close(lock_fd);
+	free(tmp_path);
+	sb_free(&out);
+	dir_db_free(&disk);
 }
 
+void dir_db_free(DirDb *db)
+{
+	for (int i = 0; i < db->num; i++)
+		free(db->ents[i].path);
+	free(db->ents);
+	for (int i = 0; i < db->num_forgotten; i++)
+		free(db->forgotten[i]);
+	free(db->forgotten);
+	free(db->filepath);
+	memset(db, 0, sizeof(*db));
+}
 
-int dalekall(Shell *shell, CmdArgv argv, int argc)
+// Changes to path, relative to the current directory unless it's absolute.
+// ".." goes back up the path as written, like cd does, so link/.. is where
+// link is. When that doesn't exist the path is resolved as it is on disk,
+// through cwd_fd. Either way the directory is opened and fchdir'd to, and
+// cwd_fd replaced. Returns 0 on success.
+static int change_dir(Shell *shelly, const char *path)
 {
-	IntList *cur = shell->bgpids, *temp;
-	mtx_lock(&shell->bg_mtx);
-	while (cur != NULL) {
-		kill_child(cur->data);
-		temp = cur;
-		cur = cur->next;
-		free(temp);
+	StrBuf canon = {0};
+	int fd, err;
+
+	path_canon(&canon, shelly->cwd, path);
+	fd = open(canon.data, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		fd = openat(shelly->cwd_fd, path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+		sb_free(&canon);
+		// A directory getcwd can't name (too deep, or unreachable from the
+		// root) fails the cd, and we go back where we were
+		if (fd >= 0 && fchdir(fd) == 0 && (canon.data = getcwd(NULL, 0)) == NULL) {
+			err = errno;
+			fchdir(shelly->cwd_fd);
+			close(fd);
+			fd = -1;
+			errno = err;
+		}
+	}
+	if (fd < 0 || fchdir(fd) < 0) {
+		if (errno == ENOENT)
+			printf("	Does not exist\n");
+		else
+			printf("	%s: %s\n", path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		sb_free(&canon);
+		return 1;
 	}
 
-	mtx_unlock(&shell->bg_mtx);
-	shell->bgpids = NULL;
-
+	if (shelly->cwd_fd >= 0)
+		close(shelly->cwd_fd);
+	shelly->cwd_fd = fd;
+	var_set("OLDPWD", shelly->cwd, 1);
+	free(shelly->cwd);
+	shelly->cwd = canon.data;
+	var_set("PWD", shelly->cwd, 1);
+	prompt_changed(shelly, "PWD");
+	dir_db_visit(shelly, shelly->cwd);
 	return 0;
 }
 
-int dalekall_help(Shell *shell, CmdArgv argv, int argc)
+// movetodir -j <word>...: the most frecent visited directory matching the
+// words. Nothing on disk is looked at but the pick, and directories that
+// are gone are forgotten.
+static int jump_dir(Shell *shelly, CmdArgv words, int num_words)
 {
-	printf("dalekall                     execute order 66\n");
-	return 0;
+	DirDb *db = &shelly->dirs;
+	int64_t now = time(NULL);
+	double score, best_score;
+	int best;
+
+	dir_db_load(shelly);
+	while (1) {
+		best = -1;
+		best_score = 0;
+		for (int i = 0; i < db->num; i++) {
+			if (strcmp(db->ents[i].path, shelly->cwd) == 0
+				|| !dir_matches(db->ents[i].path, words, num_words))
+				continue;
+			score = dir_frecency(db->ents + i, now);
+			if (best < 0 || score > best_score) {
+				best = i;
+				best_score = score;
+			}
+		}
+		if (best < 0) {
+			printf("	No match\n");
+			return 1;
+		}
+
+		if (access(db->ents[best].path, X_OK) == 0)
+			return change_dir(shelly, db->ents[best].path);
+		db->forgotten = (char **) realloc(db->forgotten,
+			sizeof(char *) * (db->num_forgotten + 1));
+		db->forgotten[db->num_forgotten++] = db->ents[best].path;
+		db->ents[best] = db->ents[--db->num];
+		db->dirty = 1;
+	}
 }
 
-int dalek(Shell *shell, CmdArgv argv, int argc)
+int movetodir(Shell *shelly, CmdArgv argv, int argc)
 {
-  if (argc != 2)
-    return 1;
-
-  int pid = strtol(argv[1], NULL, 10);
-	kill_child(pid);
+	if (argc >= 3 && strcmp(argv[1], "-j") == 0) {
+		if (jump_dir(shelly, argv + 2, argc - 2) != 0)
+			return 0;
+	}
+	else if (argc != 2)
+		return 1;
+	else if (change_dir(shelly, argv[1]) != 0)
+		return 0;
 
+	printf("    changed directory: %s\n", shelly->cwd);
 	return 0;
 }
 
-int dalek_help(Shell *shell, CmdArgv argv, int argc)
+// The directory stack, top first, after the current directory
+static void print_dir_stack(Shell *shelly)
 {
-  printf("dalek <pid>                  kill the process w/ pid <pid>\n");	
-	return 0;
+	printf("%s", shelly->cwd);
+	for (int i = shelly->dir_stack_len - 1; i >= 0; i--)
+		printf(" %s", shelly->dir_stack[i]);
+	printf("\n");
 }
 
-// Write alpha numberic dirname to dir and returns the ending location in path
-// Returns NULL at the end of the path
-char* get_next_dir(char *dir, char *path)
+int pushd(Shell *shell, CmdArgv argv, int argc)
 {
-  if (*path == '/') {
-    dir[0] = '/';
-    dir[1] = '\0'; 
-    return path + 1;
-  }
-
-	while (*path != '/') {
-    putc(*path, stdin);
-		*dir = *path;
+	char *prev;
 
-		if (*path == '\0')
-			return NULL;
+	if (argc > 2)
+		return 1;
 
-		path++;
-		dir++;
+	prev = strdup(shell->cwd);
+	if (argc == 1) {
+		// Swap with the top
+		if (shell->dir_stack_len == 0) {
+			printf("	Directory stack is empty\n");
+			free(prev);
+			return 0;
+		}
+		if (change_dir(shell, shell->dir_stack[shell->dir_stack_len - 1]) != 0) {
+			free(prev);
+			return 0;
+		}
+		free(shell->dir_stack[--shell->dir_stack_len]);
+	}
+	else if (change_dir(shell, argv[1]) != 0) {
+		free(prev);
+		return 0;
 	}
 
-  *dir = '\0';
-
-	// Move until next non-'/' to supports paths like
-	// /dev///whoops/too//many//slashes
-	while (*path == '/')
-		path++;
+	if (shell->dir_stack_len == shell->dir_stack_cap) {
+		shell->dir_stack_cap = shell->dir_stack_cap ? shell->dir_stack_cap * 2 : 8;
+		shell->dir_stack = (char **) realloc(shell->dir_stack, sizeof(char *) * shell->dir_stack_cap);
+	}
+	shell->dir_stack[shell->dir_stack_len++] = prev;
+	print_dir_stack(shell);
+	return 0;
+}
 
-	return path;
+int pushd_help(Shell *shell, CmdArgv argv, int argc)
+{
+	printf("pushd [dir]                  change cwd, remembering the last one\n"
+				 "                             no dir swaps with the last one\n");
+	return 0;
 }
 
-int movetodir(Shell *shelly, CmdArgv argv, int argc)
+int popd(Shell *shell, CmdArgv argv, int argc)
 {
-	if (argc != 2)
+	if (argc != 1)
 		return 1;
-	
-	char *path = argv[1];
-	char dirname[CMD_MAX_LEN];
-  
-  // while ((path = get_next_dir(dirname, path)) != NULL)
-  //   printf("%s\n", dirname);
-  // printf("%s\n", dirname);
-
-  struct dirent *dp;
-	char parsedDir[100] = "/";
-	char newDir[100];
-	DIR* dir;
-	
-	// If navigate up
-	if (!strcmp(path,".."))
-	{
-    strcpy(newDir, shelly->cwd);
-    int removeLen = 0;
-    for (int i = strlen(shelly->cwd); i > 0; i--)
-    {
-      if (newDir[i] == '/')
-        break;
-      
-      removeLen++;
-    }
-    newDir[strlen(shelly->cwd)-removeLen] = '\0';
-    dir = opendir(newDir);
-	}
-	// If navigate down
-	else {
-		strcpy(newDir, shelly->cwd);
-		strcat(parsedDir, path);
-		strcat(newDir, parsedDir);
-		dir = opendir(newDir);
+	if (shell->dir_stack_len == 0) {
+		printf("	Directory stack is empty\n");
+		return 0;
 	}
-	
-	
-	if (dir) {
-		// Directory Exists
-		dp = readdir(dir);
-    fchdir(dirfd(dir));
-		
-		strcpy(shelly->cwd, newDir);
-    setenv("PWD", shelly->cwd, 1);
-		printf("    changed directory: %s\n", shelly->cwd);
-		
-		closedir(dir);
-	} else if (ENOENT == errno) {
-		// Directory does not exist.
-		printf("	Does not exist\n");
-	} else {
-		// opendir() failed for some other reason.
-		printf("	What\n");
+
+	if (change_dir(shell, shell->dir_stack[shell->dir_stack_len - 1]) == 0) {
+		free(shell->dir_stack[--shell->dir_stack_len]);
+		print_dir_stack(shell);
 	}
+	return 0;
+}
 
-	
-	return 0;	
+int popd_help(Shell *shell, CmdArgv argv, int argc)
+{
+	printf("popd                         go back to the last pushd'd directory\n");
+	return 0;
 }
 
 int movetodir_help(Shell *shell, CmdArgv argv, int argc)
 {
-  printf("movetodir <dir>              change cwd\n");	
+  printf("movetodir <dir>              change cwd\n"
+				 "movetodir -j <word>...       jump to the most used dir matching\n");	
 	return 0;	
 }
 
 int whereami(Shell *shell, CmdArgv argv, int argc)
 {
-	char cwd[PATH_MAX];
-	getcwd(cwd, sizeof(cwd));
-	printf("%s\n", cwd);
+	printf("%s\n", shell->cwd);
 	return 0;	
 }
 
@@ -928,38 +5506,164 @@ int whereami_help(Shell *shell, CmdArgv argv, int argc)
 	return 0;	
 }
 
-int history(Shell *shell, CmdArgv argv, int argc)
+// Prints entries [first, last] oldest first, numbered newest first like
+// history always has, with when they ran if times is set. Lines are built up
+// and written HIST_PRINT_CHUNK bytes at a time.
+static int print_hist_range(Shell *shell, int first, int last, int times)
 {
-	if (argc > 2)
-		return 1;
-	else if (argc == 2) {
-		if (strcmp(argv[1], "-c") != 0)	
-			return 1;
-		else {
-			remove(shell->hist_filepath);	
-			free_hist_ll(shell);
+	CmdHist *hist = &shell->hist;
+	StrBuf out = {0};
+	HistMeta meta;
+	const char *cmd;
+	char num[32], stamp[32] = "";
+	time_t stamp_when = 0;
+	struct tm tm;
+	int n, ret = 0;
+
+	// Anything printf'd before has to come out first
+	fflush(stdout);
+	sb_reserve(&out, HIST_PRINT_CHUNK + 4096);
+	for (int i = first; i <= last && ret == 0; i++) {
+		n = snprintf(num, sizeof(num), "%d: ", hist->len - 1 - i);
+		sb_append(&out, num, n);
+
+		if (times) {
+			if (hist_get_meta(hist, i, &meta) < 0 || meta.when == 0) {
+				sb_append(&out, "                     ", 21);
+			}
+			else {
+				// Runs of entries from the same second are common
+				if (meta.when != stamp_when || stamp[0] == '\0') {
+					stamp_when = meta.when;
+					localtime_r(&stamp_when, &tm);
+					strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S  ", &tm);
+				}
+				sb_append(&out, stamp, strlen(stamp));
+			}
+		}
+
+		cmd = hist_get(hist, i);
+		sb_append(&out, cmd, strlen(cmd));
+		sb_append(&out, "\n", 1);
+		if (out.len >= HIST_PRINT_CHUNK) {
+			ret = write_all(STDOUT_FILENO, out.data, out.len);
+			out.len = 0;
 		}
 	}
-	else {
-		void print_hist_list(Shell *shelly);
-		history_rev(shell->hist, 0);
+	if (ret == 0)
+		ret = write_all(STDOUT_FILENO, out.data, out.len);
+
+	sb_free(&out);
+	// A closed pipe isn't a usage error
+	return 0;
+}
+
+// Parses a history number, -1 if it isn't one
+static int hist_number(const char *str)
+{
+	char *end;
+	long n = strtol(str, &end, 10);
+
+	if (end == str || *end != '\0' || n < 0 || n > INT32_MAX)
+		return -1;
+	return n;
+}
+
+// history -s <pattern>: the entries containing the rest of the line, numbered
+// like history numbers them
+static int history_search(Shell *shell, CmdArgv argv, int argc)
+{
+	CmdHist *hist = &shell->hist;
+	StrBuf pat = {0};
+	int *found, n, before;
+
+	for (int i = 2; i < argc; i++) {
+		if (i > 2)
+			sb_append(&pat, " ", 1);
+		sb_append(&pat, argv[i], strlen(argv[i]));
 	}
 
-	return 0;	
+	load_hist(shell);
+	// Not the history -s line itself
+	before = hist->len;
+	if (shell_is_interactive && shell->input == &shell->main_input)
+		before--;
+	found = (int *) malloc(sizeof(int) * (before > 0 ? before : 1));
+	n = hist_search(shell, pat.data, pat.len, before, found, before);
+	// Found newest first, printed oldest first
+	while (n-- > 0)
+		printf("%d: %s\n", hist->len - 1 - found[n], hist_get(hist, found[n]));
+
+	free(found);
+	sb_free(&pat);
+	return 0;
 }
 
-void history_rev(CmdHist *hist, int i)
+int history(Shell *shell, CmdArgv argv, int argc)
 {
-	if (hist->next)
-		history_rev(hist->next, i+1);	
-	
-	printf("%d: %s\n", i, hist->cmd);
+	int times = 0, from, to, n;
+
+	if (argc >= 3 && strcmp(argv[1], "-s") == 0)
+		return history_search(shell, argv, argc);
+	else if (argc == 2 && strcmp(argv[1], "-c") == 0) {
+		// Swap in an empty file rather than truncating, the old one may be
+		// mapped. Holding the lock on the old file means no other shell is
+		// mid-write; they notice the new inode once they get the lock.
+		if (hist_lock(shell) == 0) {
+			if (shell->hist.binary)
+				hist_file_rewrite(shell->hist_filepath, &shell->hist, 0, 0);
+			else
+				remove(shell->hist_filepath);	
+			close(shell->hist.fd);
+			shell->hist.fd = -1;
+		}
+		hist_free(&shell->hist);
+		hist_index_free(&shell->hist_index);
+		shell->hist.flushed = 0;
+		shell->hist.text_lines = 0;
+		shell->hist.loaded = 1;
+		return 0;
+	}
+
+	if (argc > 1 && strcmp(argv[1], "-t") == 0) {
+		times = 1;
+		argv++;
+		argc--;
+	}
+
+	load_hist(shell);
+	// Numbered newest first, printed oldest first
+	if (argc == 1) {
+		return print_hist_range(shell, 0, shell->hist.len - 1, times);
+	}
+	else if (argc == 2 && (n = hist_number(argv[1])) >= 0) {
+		// The last n
+		return print_hist_range(shell, n < shell->hist.len ? shell->hist.len - n : 0,
+			shell->hist.len - 1, times);
+	}
+	else if (argc == 4 && strcmp(argv[1], "-r") == 0
+		&& (from = hist_number(argv[2])) >= 0 && (to = hist_number(argv[3])) >= 0) {
+		// Either way round
+		if (from < to) {
+			n = from;
+			from = to;
+			to = n;
+		}
+		from = shell->hist.len - 1 - from;
+		to = shell->hist.len - 1 - to;
+		return print_hist_range(shell, from < 0 ? 0 : from, to, times);
+	}
+
+	return 1;
 }
 
 int history_help(Shell *shell, CmdArgv argv, int argc)
 {
-  printf("history [-c]                 prints history\n"
-				 "                             -c to clear history\n");	
+  printf("history [-t] [n]             prints history, or the last n entries\n"
+				 "                             -t to show when they ran\n"
+				 "history [-t] -r <a> <b>      prints entries a to b\n"
+				 "history -c                   clears history\n"
+				 "history -s <pattern>         prints entries containing <pattern>\n");	
 	return 0;	
 }
 
@@ -982,14 +5686,16 @@ int replay(Shell *shell, CmdArgv argv, int argc)
 		return 1;
 	}
 
+	load_hist(shell);
 	int replay_num = strtol(argv[1], NULL, 10);
   // Need to add one because the cmd string that called this function is now in
   // history
-	int i = replay_num + 1;
-	CmdHist *hist = shell->hist;
+	int i = shell->hist.len - 2 - replay_num;
+	const char *hist_cmd = hist_get(&shell->hist, i);
 	CmdArgv replay_argv;
 	int replay_argc;
 	const CmdDef *replay_cmd;
+	Pipeline outer = pipeline;
 	const int max_recursive_replay = 16;
 	static int recursive_relay_count = 0;
 
@@ -998,32 +5704,34 @@ int replay(Shell *shell, CmdArgv argv, int argc)
 		return 1;
 	}
 
-	while (i > 0 && hist) {
-		hist = hist->next;
-		i--;
-	}
-
-	// Either couldn't go back replay_num spaces or we could but it's NULL
-	if (i != 0 || hist == NULL) {
+	// Couldn't go back replay_num spaces
+	if (replay_num < 0 || hist_cmd == NULL) {
 		printf("The history doesn't go back that far (%d)\n", replay_num);
 		return 1;	
 	}
 
-	printf("Running '%s'\n", hist->cmd);
-	int parse_result = parse(&replay_cmd, replay_argv, &replay_argc, hist->cmd);	
+	printf("Running '%s'\n", hist_cmd);
+	// Parsing replaces the pipeline global, the caller still has to close the
+	// outer one's redirections
+	int parse_result = parse(&shell->cmd_arena, &replay_cmd, &replay_argv, &replay_argc, hist_cmd);	
 	if (!parse_result) {
-		if (replay_cmd->func == replay) 
-			recursive_relay_count++;
+		read_heredocs(shell);
+		if (open_redirs() == PARSE_OK) {
+			if (replay_cmd->func == replay) 
+				recursive_relay_count++;
 
-		replay_cmd->func(shell, replay_argv, replay_argc);	
+			replay_cmd->func(shell, replay_argv, replay_argc);	
 
-		if (replay_cmd->func == replay) 
-			recursive_relay_count--;
+			if (replay_cmd->func == replay) 
+				recursive_relay_count--;
+		}
+		close_redirs();
 	}
 	else {
 		printf("Invalid command!\n");
 	}
 
+	pipeline = outer;
 	return 0;	
 }
 
@@ -1051,97 +5759,509 @@ int shell_help(Shell *shell, CmdArgv argv, int argc)
 
 void print_hist_list(Shell *shelly)
 {
-  CmdHist *hist = shelly->hist;
+  load_hist(shelly);
   printf("Printing history list...\n");
-  while (hist != NULL) {
-    printf("%s\n", hist->cmd);
-    hist = hist->next;
-  }
+  for (int i = shelly->hist.len - 1; i >= 0; i--)
+    printf("%s\n", hist_get(&shelly->hist, i));
   printf("End of history.\n");
 }
 
 int print_bgpids_help(Shell *shelly, CmdArgv argv, int argc)
 {
-	printf("lsbg                         print current background pids\n");
+	printf("lsbg                         list background jobs and recently finished ones\n");
 	return 0;
 }
 
+static void print_job(const Job *job, int64_t now)
+{
+	static const char *states[] = {"free", "running", "stopped", "done"};
+	int64_t end = job->state == JOB_DONE ? job->end_ns : now;
+	char code[12] = "-";
+
+	if (job->state == JOB_DONE)
+		snprintf(code, sizeof(code), "%d", job->status);
+	// Usage is only known for processes that were reaped
+	printf("%4d  %-8s  %4s  %8.2fs  %7.2fs  %7.2fs  %8ld  %6ld  %s\n",
+		job->id, states[job->state], code, (end - job->start_ns) / 1e9,
+		job->usage.user_us / 1e6, job->usage.sys_us / 1e6,
+		job->usage.max_rss_kb, job->usage.ctx_switches, job->cmd);
+}
+
 int print_bgpids(Shell *shelly, CmdArgv argv, int argc)
 {
-	IntList *cur = shelly->bgpids;
-	while (cur != NULL) {
-		printf("%d\n", cur->data);
-		cur = cur->next;
+	JobTable *table = &shelly->jobs;
+	int64_t now = now_ns();
+	int first;
+
+	printf("%4s  %-8s  %4s  %9s  %8s  %8s  %8s  %6s  %s\n", "ID", "STATE", "EXIT",
+		"TIME", "USER", "SYS", "RSS(KB)", "CTXSW", "COMMAND");
+	for (int i = 0; i < table->cap; i++) {
+		if (table->jobs[i].state != JOB_FREE)
+			print_job(&table->jobs[i], now);
 	}
 
+	first = table->done_next - table->num_done + JOB_DONE_MAX;
+	for (int i = 0; i < table->num_done; i++)
+		print_job(&table->done[(first + i) % JOB_DONE_MAX], now);
+
 	return 0;
 }
 
-void add_bgpid(Shell *shelly, int pid)
+// Joins the stages of a pipeline back into a (malloc'd) command line
+char* job_cmdline(char **argv, char ***stages, int num_stages)
+{
+	StrBuf buf = {0};
+
+	for (int i = 0; i <= num_stages; i++) {
+		if (i > 0)
+			sb_append(&buf, " | ", 3);
+		for (char **arg = i == 0 ? argv : stages[i - 1]; *arg; arg++) {
+			if (arg != (i == 0 ? argv : stages[i - 1]))
+				sb_append(&buf, " ", 1);
+			sb_append(&buf, *arg, strlen(*arg));
+		}
+	}
+	sb_append(&buf, "", 1);
+
+	return buf.data;
+}
+
+static uint32_t job_pid_hash(pid_t pid)
 {
-	IntList *old = shelly->bgpids;
-	IntList *new = (IntList *) malloc(sizeof(IntList));
-	new->next = old;
-	new->data = pid;
-	shelly->bgpids = new;
+	return (uint32_t) pid * 2654435761u;
 }
 
-void remove_bgpid(Shell *shelly, int pid)
+static void job_pid_insert(JobTable *table, pid_t pid, int job, int stage)
 {
-	IntList *temp, *prev = NULL;
-	temp = shelly->bgpids;
+	JobPid *old = table->pids;
+	int old_cap = table->pid_cap;
+	uint32_t mask, i;
+
+	if ((table->pid_count + 1) * 2 > table->pid_cap) {
+		table->pid_cap = old_cap ? old_cap * 2 : 64;
+		table->pids = (JobPid *) calloc(table->pid_cap, sizeof(JobPid));
+		table->pid_count = 0;
+		for (int j = 0; j < old_cap; j++) {
+			if (old[j].pid != 0)
+				job_pid_insert(table, old[j].pid, old[j].job, old[j].stage);
+		}
+		free(old);
+	}
+
+	mask = table->pid_cap - 1;
+	for (i = job_pid_hash(pid) & mask; table->pids[i].pid != 0; i = (i + 1) & mask)
+		;
+	table->pids[i].pid = pid;
+	table->pids[i].job = job;
+	table->pids[i].stage = stage;
+	table->pid_count++;
+}
 
-	while (temp != NULL && temp->data != pid) {
-		prev = temp;
-		temp = temp->next;
+static JobPid* job_pid_find(JobTable *table, pid_t pid)
+{
+	uint32_t mask = table->pid_cap - 1, i;
+
+	if (table->pid_cap == 0)
+		return NULL;
+
+	for (i = job_pid_hash(pid) & mask; table->pids[i].pid != 0; i = (i + 1) & mask) {
+		if (table->pids[i].pid == pid)
+			return &table->pids[i];
 	}
+	return NULL;
+}
 
-	// Will not be NULL if stopped before end of the list
-	if (temp != NULL) {
-		if (prev == NULL) {
-			// Is the head
-			temp = temp->next;
-			free(shelly->bgpids);
-			shelly->bgpids = temp;
-		}	
-		else {
-			prev->next = temp->next;
-			free(temp);
+// Backward shift deletion, so lookups never have to skip tombstones
+static void job_pid_remove(JobTable *table, JobPid *entry)
+{
+	uint32_t mask = table->pid_cap - 1;
+	uint32_t hole = entry - table->pids, i = hole, home;
+
+	while (1) {
+		i = (i + 1) & mask;
+		if (table->pids[i].pid == 0)
+			break;
+		home = job_pid_hash(table->pids[i].pid) & mask;
+		// Move it back unless its home is cyclically in (hole, i]
+		if (((i - home) & mask) >= ((i - hole) & mask)) {
+			table->pids[hole] = table->pids[i];
+			hole = i;
 		}
 	}
+	table->pids[hole].pid = 0;
+	table->pid_count--;
 }
 
-void child_term_handler(int signum)
+// Adds a background pipeline, taking ownership of cmd. Returns its job ID.
+int add_job(Shell *shelly, pid_t *pids, int num_pids, char *cmd)
 {
-	// https://www.gnu.org/software/libc/manual/html_mono/libc.html#Process-Completion
-	int pid, status, serrno;
-  serrno = errno;
-	
-	mtx_lock(&root_shell->bg_mtx);
+	JobTable *table = &shelly->jobs;
+	struct epoll_event ev;
+	int slot, old_cap;
+	Job *job;
+
+	if (table->free_head < 0) {
+		old_cap = table->cap;
+		table->cap = old_cap ? old_cap * 2 : 16;
+		table->jobs = (Job *) realloc(table->jobs, sizeof(Job) * table->cap);
+		// Lowest slots come off the free list first
+		for (int i = table->cap - 1; i >= old_cap; i--) {
+			table->jobs[i].state = JOB_FREE;
+			table->jobs[i].next_free = table->free_head;
+			table->free_head = i;
+		}
+	}
 
-  while (1) {
-		pid = waitpid (WAIT_MYPGRP, &status, WNOHANG);
-		if (pid < 0)
-			{
-				// perror ("waitpid");
-				break;
+	slot = table->free_head;
+	job = &table->jobs[slot];
+	table->free_head = job->next_free;
+	table->num_running++;
+
+	job->id = slot + 1;
+	job->state = JOB_RUNNING;
+	job->pgid = pids[0];
+	job->pids = (pid_t *) malloc(sizeof(pid_t) * num_pids);
+	job->pidfds = (int *) malloc(sizeof(int) * num_pids);
+	job->num_pids = job->left = num_pids;
+	job->status = 0;
+	job->cmd = cmd;
+	job->start_ns = now_ns();
+	job->end_ns = 0;
+	memset(&job->usage, 0, sizeof(job->usage));
+
+	for (int i = 0; i < num_pids; i++) {
+		job->pids[i] = pids[i];
+		job->pidfds[i] = -1;
+		job_pid_insert(table, pids[i], slot, i);
+
+		if (shelly->use_pidfd) {
+			// Readable once the process exits (or right away if it already has)
+			job->pidfds[i] = syscall(SYS_pidfd_open, pids[i], 0);
+			ev.events = EPOLLIN;
+			ev.data.u64 = EV_JOB(slot, i);
+			if (job->pidfds[i] >= 0
+				&& epoll_ctl(shelly->epoll_fd, EPOLL_CTL_ADD, job->pidfds[i], &ev) < 0) {
+				close(job->pidfds[i]);
+				job->pidfds[i] = -1;
 			}
-		if (pid == 0)
+		}
+	}
+
+	return job->id;
+}
+
+Job* find_job(Shell *shelly, pid_t pid, int *stage)
+{
+	JobPid *entry = job_pid_find(&shelly->jobs, pid);
+
+	if (entry == NULL)
+		return NULL;
+	*stage = entry->stage;
+	return &shelly->jobs.jobs[entry->job];
+}
+
+// The last process of a job was reaped, move it to the done ring
+static void finish_job(Shell *shelly, Job *job)
+{
+	JobTable *table = &shelly->jobs;
+	Job *done = &table->done[table->done_next];
+	int slot = job - table->jobs;
+
+	job->state = JOB_DONE;
+	job->end_ns = now_ns();
+	printf("\n    [%d] done (%d)  %s\n", job->id, job->status, job->cmd);
+
+	table->num_finished++;
+	if (table->num_done == JOB_DONE_MAX)
+		free(done->cmd);
+	else
+		table->num_done++;
+	*done = *job;
+	done->pids = NULL;
+	done->pidfds = NULL;
+	table->done_next = (table->done_next + 1) % JOB_DONE_MAX;
+
+	free(job->pids);
+	free(job->pidfds);
+	job->state = JOB_FREE;
+	job->next_free = table->free_head;
+	table->free_head = slot;
+	table->num_running--;
+}
+
+// Reaps stage of job if it has exited. Returns 1 if it was reaped, the job is
+// freed when that was its last process.
+int reap_job(Shell *shelly, Job *job, int stage)
+{
+	struct rusage ru;
+	int status = 0;
+	pid_t pid;
+
+	if (job->state == JOB_FREE || stage >= job->num_pids || job->pids[stage] == 0)
+		return 0;
+
+	pid = wait4(job->pids[stage], &status, WNOHANG, &ru);
+	if (pid == 0 || (pid < 0 && errno == EINTR))
+		return 0;
+
+	// ECHILD means someone else already reaped it, forget it all the same
+	if (stage == job->num_pids - 1)
+		job->status = pid > 0 ? exit_code(status) : 0;
+	if (pid > 0)
+		usage_add(&job->usage, &ru);
+
+	job_pid_remove(&shelly->jobs, job_pid_find(&shelly->jobs, job->pids[stage]));
+	job->pids[stage] = 0;
+	// Closing it also takes it out of the epoll set
+	if (job->pidfds[stage] >= 0) {
+		close(job->pidfds[stage]);
+		job->pidfds[stage] = -1;
+	}
+
+	if (--job->left == 0)
+		finish_job(shelly, job);
+	return 1;
+}
+
+// Sends sig to pid through a pidfd, so it can't hit a recycled pid
+int signal_pid(pid_t pid, int sig)
+{
+	int pidfd = syscall(SYS_pidfd_open, pid, 0);
+	int ret;
+
+	if (pidfd < 0)
+		return errno == ENOSYS ? kill(pid, sig) : -1;
+
+	ret = syscall(SYS_pidfd_send_signal, pidfd, sig, NULL, 0);
+	close(pidfd);
+	return ret;
+}
+
+// Sends sig to job's process group, grandchildren included
+int signal_job(Job *job, int sig)
+{
+	static int group_pidfd = 1; // Cleared once the kernel says it's too old
+
+	// The leader's pidfd pins the group, unlike its id. It's -1 once the
+	// leader was reaped, but then the rest of the group keeps the id in use.
+	if (group_pidfd && job->pidfds[0] >= 0) {
+		if (syscall(SYS_pidfd_send_signal, job->pidfds[0], sig, NULL,
+			PIDFD_SIGNAL_PROCESS_GROUP) == 0)
+			return 0;
+		if (errno != EINVAL)
+			return -1;
+		group_pidfd = 0;
+	}
+
+	return killpg(job->pgid, sig);
+}
+
+void free_jobs(Shell *shelly)
+{
+	JobTable *table = &shelly->jobs;
+	Job *job;
+
+	for (int i = 0; i < table->cap; i++) {
+		job = &table->jobs[i];
+		if (job->state == JOB_FREE)
+			continue;
+		for (int j = 0; j < job->num_pids; j++) {
+			if (job->pidfds[j] >= 0)
+				close(job->pidfds[j]);
+		}
+		free(job->pids);
+		free(job->pidfds);
+		free(job->cmd);
+	}
+	for (int i = 0; i < table->num_done; i++)
+		free(table->done[(table->done_next - 1 - i + JOB_DONE_MAX) % JOB_DONE_MAX].cmd);
+
+	free(table->jobs);
+	free(table->pids);
+	memset(table, 0, sizeof(*table));
+	table->free_head = -1;
+}
+
+// Sets up the epoll instance. Background processes are tracked with pidfds
+// when the kernel has them (5.3+), SIGCHLD is read from a signalfd to notice
+// stops, and exits too on older kernels. Either way SIGCHLD stays blocked,
+// there's no handler reaping children behind the back of the code that waits
+// for them.
+void events_init(Shell *shelly)
+{
+	struct epoll_event ev;
+	struct rlimit lim;
+	sigset_t chld;
+	int probe;
+
+	// A pidfd per background process, let there be lots of them
+	if (getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur < lim.rlim_max) {
+		lim.rlim_cur = lim.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &lim);
+	}
+
+	sigemptyset(&chld);
+	sigaddset(&chld, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &chld, NULL);
+
+	shelly->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (shelly->epoll_fd < 0) {
+		perror("epoll_create1");
+		exit(1);
+	}
+
+	probe = syscall(SYS_pidfd_open, getpid(), 0);
+	shelly->use_pidfd = probe >= 0;
+	if (probe >= 0)
+		close(probe);
+
+	shelly->sigchld_fd = signalfd(-1, &chld, SFD_NONBLOCK | SFD_CLOEXEC);
+	ev.events = EPOLLIN;
+	ev.data.u64 = EV_SIGCHLD;
+	epoll_ctl(shelly->epoll_fd, EPOLL_CTL_ADD, shelly->sigchld_fd, &ev);
+
+	// Fails with EPERM for regular files, which are always readable anyway
+	ev.events = EPOLLIN;
+	ev.data.u64 = EV_INPUT;
+	shelly->main_input.fd = STDIN_FILENO;
+	shelly->main_input.polled =
+		epoll_ctl(shelly->epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &ev) == 0;
+	shelly->main_input.buf = (char *) malloc(INPUT_BUF_SIZE);
+	shelly->main_input.pos = shelly->main_input.len = 0;
+	shelly->input = &shelly->main_input;
+	shelly->source_depth = 0;
+}
+
+// Turns input events off while a builtin waits for children, so pending input
+// doesn't wake it up over and over
+void watch_input(Shell *shelly, int on)
+{
+	struct epoll_event ev;
+
+	if (!shelly->main_input.polled)
+		return;
+	ev.events = on ? EPOLLIN : 0;
+	ev.data.u64 = EV_INPUT;
+	epoll_ctl(shelly->epoll_fd, EPOLL_CTL_MOD, STDIN_FILENO, &ev);
+}
+
+// SIGCHLD arrived. Signals merge, so ask the kernel which children changed
+// state instead of checking every job.
+static void handle_sigchld(Shell *shelly)
+{
+	struct signalfd_siginfo sig;
+	siginfo_t info;
+	Job *job;
+	int stage;
+
+	while (read(shelly->sigchld_fd, &sig, sizeof(sig)) > 0)
+		;
+
+	while (1) {
+		info.si_pid = 0;
+		if (waitid(P_ALL, 0, &info, WSTOPPED | WCONTINUED | WNOHANG) < 0
+			|| info.si_pid == 0)
+			break;
+		if ((job = find_job(shelly, info.si_pid, &stage)) != NULL)
+			job->state = info.si_code == CLD_CONTINUED ? JOB_RUNNING : JOB_STOPPED;
+	}
+
+	if (shelly->use_pidfd)
+		return;
+
+	while (1) {
+		// Only peek, it's reaped by pid
+		info.si_pid = 0;
+		if (waitid(P_ALL, 0, &info, WEXITED | WNOHANG | WNOWAIT) < 0
+			|| info.si_pid == 0)
 			break;
-		
-		remove_bgpid(root_shell, pid);
-		printf("\n    %d done\n", pid);
+		if ((job = find_job(shelly, info.si_pid, &stage)) != NULL)
+			reap_job(shelly, job, stage);
+		else
+			waitpid(info.si_pid, NULL, 0);
+	}
+}
+
+// Handles child events until input is ready (returns 1), timeout_ms passes or
+// a signal arrives (returns 0). Finished commands still waiting to be written
+// to the history go out once the oldest is HIST_FLUSH_MAX_AGE_NS old, so an
+// idle shell doesn't sit on them; it may return early for that.
+int wait_events(Shell *shelly, int timeout_ms)
+{
+	CmdHist *hist = &shelly->hist;
+	struct epoll_event events[64];
+	int64_t due_ms = -1;
+	uint64_t data;
+	int n, input = 0;
+
+	// Not while a command runs, its entry isn't finished
+	if (hist->len > hist->flushed && !hist->running) {
+		due_ms = (hist->pending_ns + HIST_FLUSH_MAX_AGE_NS - now_ns() + 999999) / 1000000;
+		if (due_ms < 0)
+			due_ms = 0;
+		if (timeout_ms < 0 || due_ms < timeout_ms)
+			timeout_ms = due_ms;
+	}
+
+	n = epoll_wait(shelly->epoll_fd, events, 64, timeout_ms);
+	for (int i = 0; i < n; i++) {
+		data = events[i].data.u64;
+		if (data == EV_INPUT)
+			input = 1;
+		else if (data == EV_SIGCHLD)
+			handle_sigchld(shelly);
+		else
+			reap_job(shelly, &shelly->jobs.jobs[(data >> 32) - 1], (uint32_t) data);
 	}
-	mtx_unlock(&root_shell->bg_mtx);
-  errno = serrno;
+
+	if (due_ms >= 0 && now_ns() - hist->pending_ns >= HIST_FLUSH_MAX_AGE_NS)
+		flush_hist(shelly);
+	return input;
+}
+
+// Refills the current input's buffer, child events are handled while waiting
+// for stdin. Returns 0 at the end of input or once the shell is told to stop.
+ssize_t fill_input(Shell *shelly)
+{
+	InputSrc *in = shelly->input;
+	ssize_t n;
+
+	while (1) {
+		if (!shelly->is_running || in->fd < 0)
+			return 0;
+		if (in->polled && !wait_events(shelly, -1))
+			continue;
+
+		fflush(stdout);
+		n = read(in->fd, in->buf, INPUT_BUF_SIZE);
+		if (n < 0 && (errno == EINTR || errno == EAGAIN))
+			continue;
+		if (n <= 0)
+			return 0;
+		in->pos = 0;
+		in->len = n;
+		return n;
+	}
+}
+
+// getchar() for the shell's input. Returns EOF at the end of input or once
+// the shell is told to stop.
+int shell_getc(Shell *shelly)
+{
+	InputSrc *in = shelly->input;
+
+	if (in->pos == in->len && fill_input(shelly) == 0)
+		return EOF;
+	return (unsigned char) in->buf[in->pos++];
 }
 
 void termination_handler(int signum)
 {
+	// Only stop the main loop, exit_shell() then writes out pending history
 	if (root_shell == NULL)
 		return;
 
-	exit_shell(root_shell);	
+	root_shell->is_running = 0;
 }
 
 int set_env(Shell *shell, CmdArgv argv, int argc)
@@ -1149,6 +6269,14 @@ int set_env(Shell *shell, CmdArgv argv, int argc)
   if (argc > 3)
     return -1;
 
+	if (argc == 1) {
+		for (int i = 0; i < vars.cap; i++) {
+			if (vars.slots[i].name)
+				printf("%s=%s\n", vars.slots[i].name, vars.slots[i].value);
+		}
+		return 0;
+	}
+
   char *key = argv[1];
   char *val;
   if (argc == 2)
@@ -1157,51 +6285,67 @@ int set_env(Shell *shell, CmdArgv argv, int argc)
     val = argv[2];
 
   // printf("key=%s, val=%s\n", key, val);
-  setenv(key, val, 1);
-	// printf("val is now: '%s'\n", getenv(key));
+  var_set(key, val, 0);
+	prompt_changed(shell, key);
 
   return 0;
 }
 
 int set_env_help(Shell *shell, CmdArgv argv, int argc)
 {
-  printf("set <key> <value>            sets environment variable\n");	
+  printf("set [<key> <value>]          sets shell variable, export to pass it on\n");	
   return 0;
 }
 
-int main()
+// Parses and runs one line. Returns its exit code.
+int run_line(Shell *shelly, char *cmd_buf)
 {
-	Shell shelly;
-  char cmd_buf[CMD_MAX_LEN];
-  // This will be dynamically allocated later...maybe
-  char cmd_argv[ARG_MAX][ARG_MAX_LEN];
+  CmdArgv cmd_argv;
 	int cmd_argc = 0;
+	int cmd_status;
   const CmdDef *cmd_def;
 
-	init_shell(&shelly, 1);
-	printf("%s\n", get_random_greeting());
-  // print_hist_list(&shelly);
-  
-  while (shelly.is_running) {
-    if (take_input(&shelly, cmd_buf)) {
-      // printf("\n");
-    }
-    else {
-      enum ParseStatus status = parse(&cmd_def, cmd_argv, &cmd_argc, cmd_buf);
+      enum ParseStatus status = parse(&shelly->cmd_arena, &cmd_def, &cmd_argv, &cmd_argc, cmd_buf);
 			// printf("parse status: %d, cmd_def: %p\n", status, cmd_def);
+			shelly->last_status = 0;
+			cmd_status = 127;
       switch(status) {
         case PARSE_OK:
-          if(cmd_def->func(&shelly, cmd_argv, cmd_argc) != 0) {
+					// Only commands that launch programs can be piped or redirected
+					if (cmd_def->func != start && cmd_def->func != background
+						&& cmd_def->func != repeat && cmd_def->func != time_cmd) {
+						if (pipeline.num_stages > 0) {
+							printf("Invalid pipe!\n");
+							break;
+						}
+						if (pipeline.redirs[0] != NULL) {
+							printf("Invalid redirection!\n");
+							break;
+						}
+					}
+					read_heredocs(shelly);
+					if (open_redirs() != PARSE_OK) {
+						cmd_status = 1;
+						break;
+					}
+          if((cmd_status = cmd_def->func(shelly, cmd_argv, cmd_argc)) != 0) {
             printf("Usage:\n");
-            cmd_def->help(&shelly, cmd_argv, cmd_argc);
+            if (cmd_def->help)
+              cmd_def->help(shelly, cmd_argv, cmd_argc);
+          }
+          else {
+            cmd_status = shelly->last_status;
           }
 
           break;
 				case PARSE_INVALID_PIPE:
 					printf("Invalid pipe!\n");
 					break;
+				case PARSE_INVALID_REDIR:
+					printf("Invalid redirection!\n");
+					break;
 				case PARSE_INVALID_FILE:
-					printf("Invalid pipe file!\n");
+					// Only open_redirs() fails this way, and it says why
 					break;
         case PARSE_INVALID_CHAR:
         case PARSE_INVALID_CMD:
@@ -1209,10 +6353,76 @@ int main()
           break;
       }
 
-			if (pipe_to >= 0)
-				close(pipe_to);
-    }
+			close_redirs();
+			arena_reset(&shelly->cmd_arena);
+	return cmd_status;
+}
+
+// Runs lines from the current input until it ends or the shell is stopped
+void run_input(Shell *shelly)
+{
+	int from_user = shelly->input == &shelly->main_input;
+  char *cmd_buf;
+	int status, cmd_status;
+
+  while (shelly->is_running) {
+    if ((status = take_input(shelly, &cmd_buf)) < 0)
+			break;
+		if (status > 0)
+			continue;
+
+		cmd_status = run_line(shelly, cmd_buf);
+		shelly->exit_status = cmd_status;
+		// Only what the user typed goes in the history
+		if (from_user && shell_is_interactive)
+			finish_hist(shelly, cmd_status);
   }
+}
+
+// Runs the lines in str as if they were a sourced file
+void source_string(Shell *shelly, char *str)
+{
+	InputSrc src, *prev = shelly->input;
+
+	src.fd = -1;
+	src.polled = 0;
+	src.buf = str;
+	src.pos = 0;
+	src.len = strlen(str);
+
+	shelly->input = &src;
+	run_input(shelly);
+	shelly->input = prev;
+}
+
+int main(int argc, char **argv)
+{
+	Shell shelly;
+	int interactive = argc < 2 && isatty(STDIN_FILENO);
+
+	if (argc > 1 && strcmp(argv[1], "-c") == 0 && argc != 3) {
+		printf("usage: shelly [-c <command> | <script>]\n");
+		return 2;
+	}
+
+	init_shell(&shelly, interactive);
+	if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+		// shelly -c '<command>'
+		source_string(&shelly, argv[2]);
+	}
+	else if (argc > 1) {
+		// shelly script.sh
+		if (source_file(&shelly, argv[1]) < 0) {
+			printf("%s: %s\n", argv[1], strerror(errno));
+			shelly.exit_status = 127;
+		}
+	}
+	else {
+		if (interactive)
+			printf("%s\n", get_random_greeting());
+		run_input(&shelly);
+	}
 
 	exit_shell(&shelly);
+	return shelly.exit_status;
 }